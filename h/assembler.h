@@ -3,15 +3,34 @@
 
 #include "elf.h"
 #include "lexer.h"
+#include "line_index.h"
 #include "parser.h"
+#include "section.h"
+#include "source_file.h"
+#include "string_pool.h"
+#include "symbol_table.h"
+#include "text_writer.h"
 
-#include <fstream>
+#include <deque>
+#include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 
 enum class Pass { First, Second };
 enum class Result { Success, Error, Empty, End, Uneval, Reloc };
+enum class Verbosity { Quiet, Normal, Verbose };
+
+typedef struct Assembler_Options
+{
+    bool            binary;         // -e
+    bool            single_pass;    // -s
+    Verbosity       verbosity;      // -q, -v
+    std::string     listing_file;   // -l, no listing if empty
+    unsigned        threads;        // -j with a single input, parsing and encoding threads
+    Assembler_Options() : binary(false), single_pass(false), verbosity(Verbosity::Normal), threads(1) {}
+} Assembler_Options;
 
 class Addressing_Mode
 {
@@ -27,124 +46,217 @@ public:
     };
 };
 
+// *** Per-line record ***
+// One record per non-empty line, stored contiguously in file_vect. Strings are
+// interned in the assembler's string pool. Operands are classified in the first
+// pass, so an instruction record holds everything the second pass encodes.
+
+typedef struct Operand
+{
+    str_id_t    str;    // Operand text
+    uint32_t    data;   // Value, offset or address, or the symbol id (see op_type)
+} Operand;
+
+typedef struct Directive_Info
+{
+    str_id_t    param[3];   // Directive parameters
+    uint32_t    expr;       // First compiled .byte/.word expression (in data_exprs), fill size << 8 | fill byte for .align/.skip
+} Directive_Info;
+
 typedef struct Line_Info
 {
-    unsigned    line_num;
+    uint32_t    line_num;
+    str_id_t    label;
     Elf16_Addr  loc_cnt;
-    Line        line;
-    Line_Info();
-    Line_Info(unsigned line_num, Elf16_Addr loc_cnt, Line line);
+    uint8_t     content_type;
+    uint8_t     code;           // Directive::code or Instruction::code
+    uint8_t     op_size : 4;
+    uint8_t     op_cnt  : 4;
+    uint8_t     op_mode[2];     // Operand_Type << 4 | register
+    union
+    {
+        Directive_Info  dir;
+        Operand         op[2];  // Instruction operands
+    };
+
+    Line_Info(uint32_t line_num, Elf16_Addr loc_cnt);
+    Line_Info(Line_Info &&) = default;
+    Line_Info &operator=(Line_Info &&) = default;
+    Line_Info(const Line_Info &) = delete;
+    Line_Info &operator=(const Line_Info &) = delete;
+
+    uint8_t op_type(unsigned i) const { return op_mode[i] >> 4; }
+    uint8_t op_reg(unsigned i) const { return op_mode[i] & 0xf; }
 } Line_Info;
 
-typedef struct Section_Info
+static_assert(sizeof(Line_Info) <= 32, "Line_Info should fit in 32 bytes");
+
+// *** Parsed line ***
+// What the parsing threads make of a line from its text alone. The first pass
+// stores it into a Line_Info, interning strings and operand symbols.
+
+typedef struct Operand_Class
+{
+    uint8_t     mode;   // Operand_Type << 4 | register, Operand_Type::None if invalid
+    uint32_t    data;   // Value, offset or address
+    Token       symbol; // Symbol of ImmSym, RegIndSym, MemSym and PcRelSym operands
+} Operand_Class;
+
+typedef struct Parsed_Line
 {
-    std::string name;          // Section name
-    Elf16_Word  type;          // Section type
-    Elf16_Word  flags;         // Section flags
-    Elf16_Addr  loc_cnt;       // Section location counter
-    Elf16_Addr  shdrtab_index; // Section header table index
-} Section_Info;
-
-typedef struct Symtab_Entry
+    Line            line;
+    bool            ok;     // false if the line failed to parse
+    std::string     error;  // Parse error, if any
+    Operand_Class   op[2];  // Instruction operands
+} Parsed_Line;
+
+typedef std::pair<const str_id_t, std::unique_ptr<Expression>>      equ_uneval_pair_t;
+
+// *** Relocatable .equ expansion ***
+// Built once when the .equ symbol is evaluated, every use then copies the
+// template with its own relocation type and offset.
+
+typedef struct Equ_Expansion
 {
-    static Elf16_Addr symtab_index;
-    Elf16_Addr index;
-    Elf16_Sym sym;
-    bool is_equ;        // Specifies whether the symbol is defined by .equ directive
-                        // If this is true and the sym.st_shndx is SHN_UNDEF, the expression
-                        // must be evaluated on each use since the value is relocatable
-    Symtab_Entry();
-    Symtab_Entry(Elf16_Word name, Elf16_Addr value, uint8_t info, Elf16_Section shndx, bool is_equ = false);
-} Symtab_Entry;
-
-typedef struct Shdrtab_Entry
+    int                     addend;         // Value of the expression
+    std::vector<Elf16_Word> symbols;        // Symbol table index of every relocation
+    Elf16_Section           local_shndx;    // Section of the only relocation if its symbol is local, SHN_UNDEF otherwise
+    Equ_Expansion() : addend(0), local_shndx(SHN_UNDEF) {}
+} Equ_Expansion;
+
+// *** Single-pass fixup ***
+// A line whose encoding depends on symbols is reserved in the first pass and
+// encoded into the reserved bytes once all symbols are known.
+
+typedef struct Fixup
 {
-    static Elf16_Addr shdrtab_index;
-    Elf16_Addr index;
-    Elf16_Shdr shdr;
-    Shdrtab_Entry();
-    Shdrtab_Entry(Elf16_Word type, Elf16_Word flags, Elf16_Word info = 0, Elf16_Word entsize = 0, Elf16_Word size = 0);
-} Shdrtab_Entry;
-
-typedef struct Reltab_Entry
+    uint32_t        line;   // Index in file_vect
+    sect_handle_t   sect;   // Section of the line
+    uint32_t        pos;    // First reserved byte (Section_Buffer::stored() offset)
+} Fixup;
+
+// *** Encoder ***
+// Where the second pass puts the bytes and relocations of a line. Encoding
+// reads the assembler's tables but writes only through the encoder, so lines
+// of different encoders can be encoded at the same time.
+
+#define NO_PATCH SIZE_MAX
+
+typedef struct Encoder
 {
-    Elf16_Rel   rel;
-    Reltab_Entry(Elf16_Word info, Elf16_Addr offset = 0);
-} Reltab_Entry;
+    Section                     *sect;      // Section of the line
+    Section_Buffer              *data;      // Bytes go here, sect->data unless encoding a chunk
+    std::vector<Reltab_Entry>   *relocs;    // Relocations go here, nullptr for the section's relocation section
+    std::ostream                *errors;
+    uint32_t                    line;       // Index in file_vect
+    Elf16_Addr                  loc_cnt;    // Location counter
+    size_t                      patch_pos;  // Next byte to overwrite, NO_PATCH when appending
+    Encoder(Section &sect, std::ostream &errors) : sect(&sect), data(&sect.data), relocs(nullptr), errors(&errors), line(0), loc_cnt(0), patch_pos(NO_PATCH) {}
+} Encoder;
 
-typedef std::pair<const std::string, Symtab_Entry>                  symtab_pair_t;
-typedef std::pair<const std::string, Shdrtab_Entry>                 shdrtab_pair_t;
-typedef std::pair<const std::string, std::unique_ptr<Expression>>   equ_uneval_pair_t;
-typedef std::pair<int, std::vector<Reltab_Entry>>                   reloc_pair_t;
-typedef std::pair<const std::string, reloc_pair_t>                  equ_relocs_pair_t;
+// *** Listing ***
+// The bytes a line stored, recorded as the line is encoded and read back from
+// the section contents when the listing is written.
+
+#define LISTING_ROW_BYTES   8
+
+typedef struct Listing_Entry
+{
+    uint32_t        line;   // Index in file_vect
+    sect_handle_t   sect;   // Section the line was encoded in
+    uint32_t        pos;    // First stored byte (Section_Buffer::stored() offset)
+    uint32_t        count;  // Stored bytes
+} Listing_Entry;
 
 class Assembler
 {
 public:
-    Assembler(const std::string &input_file, const std::string &output_file, bool binary = false);
-    ~Assembler();
+    // Echo and errors go to messages and errors, so concurrent assemblers can keep theirs apart
+    Assembler(const std::string &input_file, const std::string &output_file, const Assembler_Options &options = Assembler_Options(),
+        std::ostream &messages = std::cout, std::ostream &errors = std::cerr);
 
     bool assemble();
 
 private:
     std::string     input_file, output_file;
-    std::ifstream   input;
-    std::ofstream   output;
-    bool            binary;
+    Source_File     source;
+    line_index_t    line_index;
+    Assembler_Options options;
+    std::ostream    &messages, &errors;
 
-    Lexer   *lexer;
-    Parser  *parser;
+    const Lexer     *lexer;
+    const Parser    *parser;
     Pass    pass;
 
     Elf16_Ehdr elf_header;
 
-    Section_Info cur_sect;
+    std::deque<Section>                                 sections;       // by handle
+    std::unordered_map<str_id_t, sect_handle_t>         section_ids;    // by name, switches only
+    Section                                             *cur_sect;
 
-    std::map<std::string, Elf16_Addr>                   lc_map;
-    std::map<std::string, Symtab_Entry>                 symtab_map;
-    std::map<std::string, Shdrtab_Entry>                shdrtab_map;
-    std::map<std::string, std::vector<Reltab_Entry>>    reltab_map;
-    std::map<std::string, std::vector<Elf16_Half>>      section_map;
+    Symbol_Table                                        symtab;
 
-    std::map<std::string, std::unique_ptr<Expression>>  equ_uneval_map;
-    std::map<std::string, reloc_pair_t>                 equ_reloc_map;
+    std::map<str_id_t, std::unique_ptr<Expression>>     equ_uneval_map;
+    std::vector<Equ_Expansion>                          equ_expansions; // [0] is a dummy
 
     std::vector<std::string>    strtab_vect;
-    std::vector<std::string>    shstrtab_vect;
     std::vector<Elf16_Sym*>     symtab_vect;
     std::vector<Elf16_Shdr*>    shdrtab_vect;
 
+    String_Pool                 strings;
     std::vector<Line_Info>      file_vect;
+    std::vector<Expression>     data_exprs;
     unsigned                    file_idx;
 
+    std::vector<Fixup>          fixups;
+    std::vector<Listing_Entry>  listing;        // Only with a listing file
+
+    bool read_input();
     bool run_first_pass();
     bool run_second_pass();
+    bool run_parallel_second_pass();
+    bool emit_line(Line_Info &info);
+    bool apply_fixups();
 
     bool evaluate_expressions();
 
     void print_line(Line_Info &info);
-    void print_file(std::ostream &out);
+    void list_line(sect_handle_t sect, size_t pos);
+    bool write_listing();
+    void print_file(Text_Writer &out);
 
-    void finalize();
-    void write_output();
+    bool finalize();
+    bool write_output();
+    bool write_binary();
 
+    void parse_line(Parsed_Line &parsed, const Line_Span &span, std::ostream &errors) const;
+    void store_line(const Parsed_Line &parsed, Line_Info &info);
     Result process_line(Line_Info &info);
     Result process_directive(const Directive &dir);
-    Result process_instruction(const Instruction &instr);
-    Result process_expression(const Expression &expr, int &value, bool allow_undef = false, const std::string &equ_name = "");
+    Result process_instruction(Line_Info &info);
+    bool advance(unsigned size);
+    Result process_expression(const Expression &expr, int &value, bool allow_undef = false, Equ_Expansion *expansion = nullptr, Encoder *enc = nullptr);
+
+    Result encode_line(Encoder &enc, uint32_t line);
+    Result encode_instruction(Encoder &enc, const Line_Info &info);
+    Result encode_data(Encoder &enc, const Line_Info &info);
 
-    bool get_symtab_entry(const std::string &str, Symtab_Entry &entry, bool silent = false);
+    Symtab_Entry *get_symtab_entry(str_id_t symbol, std::ostream &errors, bool silent = false);
     std::string get_section_name(unsigned shndx);
-    int get_operand_code_size(const std::string &str, uint8_t operand_size);
+    bool classify_operand(const Token &str, uint8_t op_size, Operand_Class &result, std::ostream &errors) const;
 
-    bool add_symbol(const std::string &symbol);
-    bool add_shdr(const std::string &name, Elf16_Word type, Elf16_Word flags, bool reloc = false, Elf16_Word info = 0, Elf16_Word entsize = 0);
+    bool add_symbol(str_id_t symbol);
+    sect_handle_t add_shdr(str_id_t name, Elf16_Word type, Elf16_Word flags, bool reloc = false, Elf16_Word info = 0, Elf16_Word entsize = 0);
 
-    void push_byte(Elf16_Half byte);
-    void push_word(Elf16_Word word);
+    void store_byte(Encoder &enc, Elf16_Half byte);
+    void push_byte(Encoder &enc, Elf16_Half byte);
+    void push_word(Encoder &enc, Elf16_Word word);
+    void push_fill(Encoder &enc, Elf16_Half byte, Elf16_Word count);
 
-    bool insert_operand(const std::string &str, uint8_t size, Elf16_Addr next_instr);
-    bool insert_reloc(const std::string &symbol, Elf16_Half type, Elf16_Addr next_instr = 0, bool place = true, std::vector<Reltab_Entry> *relocs_vect = nullptr);
+    Section &rel_section(Section &sect);
+    bool insert_operand(Encoder &enc, const Line_Info &info, unsigned i, Elf16_Addr next_instr);
+    bool reloc_symbol(const Symtab_Entry &entry, str_id_t symbol, sym_handle_t &result, std::ostream &errors);
+    bool insert_reloc(Encoder *enc, str_id_t symbol, Elf16_Half type, Elf16_Addr next_instr = 0, bool place = true, std::vector<Reltab_Entry> *relocs_vect = nullptr);
 };
 
 #endif  // assembler.h
\ No newline at end of file
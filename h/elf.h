@@ -194,6 +194,7 @@ typedef struct elf16_rel
 // How to extract and insert information held in the r_info field
 
 #define ELF16_R_SYM(val)        ((val) >> 4)
+#define ELF16_R_SYM_MAX         0xfff
 #define ELF16_R_TYPE(val)       ((val) & 0xf)
 #define ELF16_R_INFO(sym, type) (((sym) << 4) + ((type) & 0xf))
 
@@ -0,0 +1,116 @@
+#ifndef _KEYWORDS_H
+#define _KEYWORDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// *** Compile-time perfect hash tables for keywords (directives and mnemonics) ***
+//
+// Keywords are hashed case-insensitively with FNV-1a, starting from a per-table
+// seed, and the slot is taken from the top bits of the hash. Every keyword entry
+// stands for up to three keys: the plain name and, if the entry is sized, the
+// name followed by the 'b' or 'w' operand size suffix. Key k belongs to entry
+// k / 3 and its suffix is given by k % 3 (see Keyword_Suffix).
+//
+// The slot table is generated by the compiler from the keyword list and the
+// seed. The seed must be chosen so that no two keys share a slot, which is
+// checked by Keyword_Table::perfect (use it in a static_assert).
+
+typedef struct Keyword
+{
+    const char  *name;  // lowercase name
+    uint8_t     code;   // Directive::code or Instruction::code
+    bool        sized;  // also accepts the b/w operand size suffix
+} Keyword;
+
+struct Keyword_Suffix { enum { None = 0, Byte, Word }; };
+
+#define KEYWORD_NONE 0xff
+
+constexpr uint32_t keyword_fold(char c)
+{
+    return (unsigned char) (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+}
+
+constexpr uint32_t keyword_hash(uint32_t h, char c)
+{
+    return (h ^ keyword_fold(c)) * 16777619u;
+}
+
+constexpr uint32_t keyword_hash(uint32_t h, const char *str)
+{
+    return *str == '\0' ? h : keyword_hash(keyword_hash(h, *str), str + 1);
+}
+
+constexpr bool keyword_valid(const Keyword *kw, unsigned key)
+{
+    return key % 3 == Keyword_Suffix::None || kw[key / 3].sized;
+}
+
+constexpr uint32_t keyword_hash(const Keyword *kw, unsigned key, uint32_t seed)
+{
+    return key % 3 == Keyword_Suffix::None ? keyword_hash(seed, kw[key / 3].name)
+        : keyword_hash(keyword_hash(seed, kw[key / 3].name), key % 3 == Keyword_Suffix::Byte ? 'b' : 'w');
+}
+
+constexpr unsigned keyword_slot(uint32_t hash, unsigned bits)
+{
+    return hash >> (32 - bits);
+}
+
+// First key that lands in the slot, or KEYWORD_NONE if the slot is empty
+constexpr uint8_t keyword_at(const Keyword *kw, unsigned cnt, uint32_t seed, unsigned bits, unsigned slot, unsigned key = 0)
+{
+    return key == cnt * 3 ? KEYWORD_NONE
+        : keyword_valid(kw, key) && keyword_slot(keyword_hash(kw, key, seed), bits) == slot ? key
+        : keyword_at(kw, cnt, seed, bits, slot, key + 1);
+}
+
+// True if every key is the first (and therefore the only) one in its slot
+constexpr bool keyword_perfect(const Keyword *kw, unsigned cnt, uint32_t seed, unsigned bits, unsigned key = 0)
+{
+    return key == cnt * 3 || ((!keyword_valid(kw, key)
+        || keyword_at(kw, cnt, seed, bits, keyword_slot(keyword_hash(kw, key, seed), bits)) == key)
+        && keyword_perfect(kw, cnt, seed, bits, key + 1));
+}
+
+template <unsigned... I> struct Index_Seq {};
+template <unsigned N, unsigned... I> struct Make_Index_Seq : Make_Index_Seq<N - 1, N - 1, I...> {};
+template <unsigned... I> struct Make_Index_Seq<0, I...> { typedef Index_Seq<I...> type; };
+
+template <const Keyword *KW, unsigned CNT, uint32_t SEED, unsigned BITS,
+          class = typename Make_Index_Seq<1u << BITS>::type>
+struct Keyword_Table;
+
+template <const Keyword *KW, unsigned CNT, uint32_t SEED, unsigned BITS, unsigned... I>
+struct Keyword_Table<KW, CNT, SEED, BITS, Index_Seq<I...>>
+{
+    static constexpr bool perfect = keyword_perfect(KW, CNT, SEED, BITS);
+    static constexpr uint8_t slots[sizeof...(I)] = { keyword_at(KW, CNT, SEED, BITS, I)... };
+
+    // Case-insensitive lookup of str followed by suffix, no allocation.
+    // Returns the key (see above) or KEYWORD_NONE.
+    static uint8_t find(const char *str, size_t len, const char *suffix = "", size_t suffix_len = 0)
+    {
+        uint32_t h = SEED;
+        for (size_t i = 0; i < len; ++i) h = keyword_hash(h, str[i]);
+        for (size_t i = 0; i < suffix_len; ++i) h = keyword_hash(h, suffix[i]);
+        uint8_t key = slots[keyword_slot(h, BITS)];
+        if (key == KEYWORD_NONE) return KEYWORD_NONE;
+        const char *name = KW[key / 3].name;
+        char last = key % 3 == Keyword_Suffix::None ? '\0' : key % 3 == Keyword_Suffix::Byte ? 'b' : 'w';
+        size_t i = 0, total = len + suffix_len;
+        for (; name[i] != '\0'; ++i)
+            if (i == total || keyword_fold(i < len ? str[i] : suffix[i - len]) != (unsigned char) name[i])
+                return KEYWORD_NONE;
+        if (last == '\0') return i == total ? key : KEYWORD_NONE;
+        if (i + 1 != total || keyword_fold(i < len ? str[i] : suffix[i - len]) != (unsigned char) last)
+            return KEYWORD_NONE;
+        return key;
+    }
+};
+
+template <const Keyword *KW, unsigned CNT, uint32_t SEED, unsigned BITS, unsigned... I>
+constexpr uint8_t Keyword_Table<KW, CNT, SEED, BITS, Index_Seq<I...>>::slots[sizeof...(I)];
+
+#endif // keywords.h
\ No newline at end of file
@@ -1,181 +1,161 @@
 #ifndef _LEXER_H
 #define _LEXER_H
 
-#include <list>
-#include <regex>
+#include <iosfwd>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
-#include <vector>
 
-// *** Regex strings that match specific tokens ***
-
-// Line START: matches all whitespace BEFORE any valid symbols
-#define REGEX_START "^\\s*"
-// Line END: matches all whitespace AFTER valid symbols and comments
-#define REGEX_END "\\s*(?:[@#;].*)?\r?$"
-
-// Valid symbol format: starts with '.' or '_' or 'a-z' then can also contain digits
-#define REGEX_SYM "[._a-zA-Z][.\\w]*"
-
-// Valid byte value format
-#define REGEX_VAL_B "[-~]?(?:0[bB][0-1]{1,8}|0[0-7]{1,3}|0[xX][\\da-fA-F]{1,2}|0|[1-9]\\d{0,2})"
-
-// Valid word value format
-#define REGEX_VAL_W "[-~]?(?:0[bB][0-1]{1,16}|0[0-7]{1,6}|0[xX][\\da-fA-F]{1,4}|0|[1-9]\\d{0,4})"
-
-// Valid content format: anything until a comment
-#define REGEX_CONTENT "[^@#;]*?"
-
-// *** Immediate addressing modes ***
-// <val> (immediate value embedded inside the instruction)
-#define REGEX_ADR_IMM_B REGEX_VAL_B "|&" REGEX_SYM
-// <val> or &<symbol_name> (immediate value embedded inside the instruction)
-#define REGEX_ADR_IMM_W REGEX_VAL_W "|&" REGEX_SYM
-
-// *** Register addressing modes ***
-// r<num>h or r<num>l (register high or low addressing)
-#define REGEX_ADR_REGDIR_B "r[0-7][hl]"
-// r<num> or sp or pc (psw can be only addressed in push/pop <=> pushf/popf) (full register addressing)
-#define REGEX_ADR_REGDIR_W "r[0-7]|sp|pc"
-
-// *** Memory addressing modes ***
-// [r<num>] or r<num>[<val>] or r<num>[<symbol_name>]
-#define REGEX_ADR_REGIND "\\[\\s*(?:" REGEX_ADR_REGDIR_W ")\\s*\\]|(?:" REGEX_ADR_REGDIR_W ")\\s*\\[\\s*(?:" REGEX_VAL_W "|" REGEX_SYM ")\\s*\\]"
-// *<val> (absolute data addressing)
-#define REGEX_ADR_ABS "\\*" REGEX_VAL_W
-// <symbol_name> or $<symbol_name> (absolute or PC-relative symbol addressing)
-#define REGEX_ADR_SYM "\\$?" REGEX_SYM
-// all memory addressing modes for both byte and word sized operands
-#define REGEX_ADR_MEM REGEX_ADR_REGIND "|" REGEX_ADR_ABS "|" REGEX_ADR_SYM
+// *** Grammar recognized by the scanner ***
+//
+// Whitespace:  [ \t\n\v\f\r]
+// Line END:    whitespace, then an optional comment ([@#;] up to the end of the
+//              line, no '\r' except the last character), then end of the line
+// Symbol:      [._a-zA-Z][._a-zA-Z0-9]*
+// Byte value:  [-~]?(0[bB][01]{1,8}|0[0-7]{1,3}|0[xX][0-9a-fA-F]{1,2}|0|[1-9][0-9]{0,2})
+// Word value:  [-~]?(0[bB][01]{1,16}|0[0-7]{1,6}|0[xX][0-9a-fA-F]{1,4}|0|[1-9][0-9]{0,4})
+// Content:     anything until a comment, surrounding whitespace trimmed
+// Expression:  (<word value> | <symbol> | [()+-*/%&|^])+ separated by optional whitespace,
+//              no trailing whitespace and no line breaks after the first token
+//
+// *** Addressing modes ***
+// imm_b:       <byte value> | &<symbol>
+// imm_w:       <word value> | &<symbol>
+// regdir_b:    r[0-7][hl]
+// regdir_w:    r[0-7] | sp | pc (psw can be only addressed in push/pop <=> pushf/popf)
+// regind:      [<regdir_w>] | <regdir_w>[<word value>] | <regdir_w>[<symbol>]
+// memabs:      *<word value>
+// memsym:      <symbol> | $<symbol> (absolute or PC-relative symbol addressing)
+// mem:         regind | memabs | memsym
+//
+// Every line is scanned exactly once, left to right, driven by a character class
+// table. There is no backtracking and no recursion, so the cost is linear in the
+// length of the line and the stack usage is bounded.
+
+#define TOKENS_MAX 4
+
+// Addressing mode classes accepted by Lexer::match_operand
+#define ADR_IMM     0x1 // imm_b or imm_w depending on the operand size
+#define ADR_REGDIR  0x2 // regdir_b or regdir_w depending on the operand size
+#define ADR_MEM     0x4 // mem (same for both operand sizes)
+
+// *** Token ***
+// Non-owning view of a part of a string (std::string_view is C++17). It is only
+// valid while the string it points into is alive and unchanged, so anything
+// that outlives the source line must be copied out with str().
+
+typedef struct Token
+{
+    const char  *ptr;
+    size_t      len;
+
+    Token() : ptr(""), len(0) {}
+    Token(const char *begin, const char *end) : ptr(begin), len(end - begin) {}
+    Token(const char *str) : ptr(str), len(strlen(str)) {}
+    Token(const std::string &str) : ptr(str.data()), len(str.size()) {}
+
+    const char *data() const { return ptr; }
+    const char *begin() const { return ptr; }
+    const char *end() const { return ptr + len; }
+    size_t size() const { return len; }
+    size_t length() const { return len; }
+    bool empty() const { return len == 0; }
+    char operator[](size_t i) const { return ptr[i]; }
+    Token substr(size_t pos) const { return Token(ptr + pos, ptr + len); }
+    std::string str() const { return std::string(ptr, len); }
+
+    bool operator==(const Token &t) const { return len == t.len && memcmp(ptr, t.ptr, len) == 0; }
+    bool operator!=(const Token &t) const { return !(*this == t); }
+} Token;
+
+std::ostream &operator<<(std::ostream &out, const Token &token);
+
+// Fixed-capacity token array, a line never has more than TOKENS_MAX tokens
+typedef struct Token_Array
+{
+    Token       tokens[TOKENS_MAX];
+    unsigned    cnt;
 
-// *** Combinational addressing modes ***
-// immediate and register direct addressing modes for byte sized operands
-#define REGEX_ADR_IMMREG_B REGEX_ADR_IMM_B "|" REGEX_ADR_REGDIR_B
-// immediate and register direct addressing modes for word sized operands
-#define REGEX_ADR_IMMREG_W REGEX_ADR_IMM_W "|" REGEX_ADR_REGDIR_W
-// register and memory addressing modes for byte sized operands
-#define REGEX_ADR_REGMEM_B REGEX_ADR_REGDIR_B "|" REGEX_ADR_MEM
-// register and memory addressing modes for word sized operands
-#define REGEX_ADR_REGMEM_W REGEX_ADR_REGDIR_W "|" REGEX_ADR_MEM
+    Token_Array() : cnt(0) {}
+    size_t size() const { return cnt; }
+    const Token &operator[](size_t i) const { return tokens[i]; }
+    void push_back(const Token &token) { if (cnt < TOKENS_MAX) tokens[cnt++] = token; }
+} Token_Array;
 
-#define CONTENT_CNT 4
+typedef Token_Array tokens_t;
 
-struct Content_Match { enum { Directive, ZeroAddr, OneAddr, TwoAddr }; };
+// Comma-separated list, split lazily. Whitespace before each comma is dropped.
+// Empty trailing token is dropped, but an empty string still yields one (empty) token.
+class Comma_Split
+{
+public:
+    class iterator
+    {
+    public:
+        iterator(const char *tok, const char *end, bool first);
+        const Token &operator*() const { return cur; }
+        iterator &operator++();
+        bool operator!=(const iterator &it) const { return tok != it.tok; }
+    private:
+        const char  *tok, *next, *end;
+        bool        first;
+        Token       cur;
+        void load();
+    };
+
+    Comma_Split(const Token &str) : str(str) {}
+    iterator begin() const { return iterator(str.begin(), str.end(), true); }
+    iterator end() const { return iterator(nullptr, nullptr, false); }
+    size_t size() const;
+private:
+    Token str;
+};
 
-typedef std::vector<std::string> tokens_t;
+// Expression tokens, scanned one at a time
+class Expression_Scanner
+{
+public:
+    Expression_Scanner(const Token &str);
+    bool next(Token &token);                    // false at the end or at an invalid token
+    bool valid() const { return p == end; }     // true once the whole expression was scanned
+private:
+    const char  *p, *end;
+    bool        first;
+};
 
 class Lexer
 {
 public:
-    Lexer();
-    ~Lexer() {};
+    // The lexer has no state, a single instance is shared by the whole process
+    static const Lexer &shared();
 
     static std::string tolower(const std::string &str);
 
-    bool is_empty(const std::string &str);
-    std::list<std::string> split_string(const std::string &str);
-    bool match_symbol(const std::string &str, std::string &result);
-    bool match_byte(const std::string &str, std::string &result);
-    bool match_word(const std::string &str, std::string &result);
-    bool match_imm_b(const std::string &str, std::string &value);
-    bool match_imm_w(const std::string &str, std::string &value);
-    bool match_regdir_b(const std::string &str, std::string &reg);
-    bool match_regdir_w(const std::string &str, std::string &reg);
-    bool match_regind(const std::string &str, std::string &reg);
-    bool match_regindoff(const std::string &str, std::string &reg, std::string &offset);
-    bool match_regindsym(const std::string &str, std::string &reg, std::string &symbol);
-    bool match_memsym(const std::string &str, std::string &symbol);
-    bool match_memabs(const std::string &str, std::string &address);
-
-    bool tokenize_line(const std::string &str, tokens_t &tokens);
-    bool tokenize_directive(const std::string &str, tokens_t &tokens);
-    bool tokenize_zeroaddr(const std::string &str, tokens_t &tokens);
-    bool tokenize_oneaddr(const std::string &str, tokens_t &tokens);
-    bool tokenize_twoaddr(const std::string &str, tokens_t &tokens);
-    bool tokenize_expression(const std::string &str, tokens_t &tokens);
+    bool is_empty(const Token &str) const;
+    Comma_Split split_string(const Token &str) const;
+    bool match_symbol(const Token &str, Token &result) const;
+    bool match_byte(const Token &str, Token &result) const;
+    bool match_word(const Token &str, Token &result) const;
+    bool match_imm_b(const Token &str, Token &value) const;
+    bool match_imm_w(const Token &str, Token &value) const;
+    bool match_regdir_b(const Token &str, Token &reg) const;
+    bool match_regdir_w(const Token &str, Token &reg) const;
+    bool match_regind(const Token &str, Token &reg) const;
+    bool match_regindoff(const Token &str, Token &reg, Token &offset) const;
+    bool match_regindsym(const Token &str, Token &reg, Token &symbol) const;
+    bool match_memsym(const Token &str, Token &symbol) const;
+    bool match_memabs(const Token &str, Token &address) const;
+
+    bool tokenize_line(const Token &str, tokens_t &tokens) const;
+    bool tokenize_directive(const Token &str, tokens_t &tokens) const;
+    bool tokenize_instruction(const Token &str, tokens_t &tokens) const;
+    bool match_operand(const Token &str, uint8_t modes, bool word) const;
+    Expression_Scanner tokenize_expression(const Token &str) const;
 private:
-    static std::list<std::string> tokenize_string(const std::string &str, const std::regex &regex);
-    static bool tokenize_content(const std::string &str, const std::regex &regex, tokens_t &tokens, bool ignore_second = false);
-
-    std::regex
-        empty_rx, line_rx, split_rx, symbol_rx, byte_rx, word_rx,
-        operand_1b_rx, operand_2b_rx,
-        imm_b_rx, imm_w_rx, regdir_b_rx, regdir_w_rx,
-        regind_rx, regindoff_rx, regindsym_rx, memsym_rx, memabs_rx,
-        directive_rx, zeroaddr_rx, oneaddr_rx, twoaddr_rx, expr_rx;
-
-    const std::string
-        empty_str = REGEX_START REGEX_END,
-        line_str = REGEX_START "(?:(" REGEX_SYM "):)?\\s*(" REGEX_CONTENT ")?" REGEX_END,
-        split_str = "\\s*,",
-        symbol_str = "\\s*(" REGEX_SYM ")\\s*",
-        byte_str = "\\s*(" REGEX_VAL_B ")\\s*",
-        word_str = "\\s*(" REGEX_VAL_W ")\\s*",
-        imm_b_str = "\\s*(" REGEX_ADR_IMM_B ")\\s*",
-        imm_w_str = "\\s*(" REGEX_ADR_IMM_W ")\\s*",
-        regdir_b_str = "\\s*(" REGEX_ADR_REGDIR_B ")\\s*",
-        regdir_w_str = "\\s*(" REGEX_ADR_REGDIR_W ")\\s*",
-        regind_str = "\\s*\\[\\s*(" REGEX_ADR_REGDIR_W ")\\s*\\]\\s*",
-        regindoff_str = "\\s*(" REGEX_ADR_REGDIR_W ")\\s*\\[\\s*(" REGEX_VAL_W ")\\s*\\]\\s*",
-        regindsym_str = "\\s*(" REGEX_ADR_REGDIR_W ")\\s*\\[\\s*(" REGEX_SYM ")\\s*\\]\\s*",
-        memsym_str = "\\s*(\\$?" REGEX_SYM ")\\s*",
-        memabs_str = "\\s*\\*(" REGEX_VAL_W ")\\s*",
-        directive_str = {
-            REGEX_START
-            "\\.(?:"
-            // flags: a-allocatable, e-excluded from executable and shared library (bss), w-writable, x-executable
-            "(section)\\s+(" REGEX_SYM ")\\s*(?:,\\s*\"(a?e?w?x?)\")?|"
-            "(text|data|bss|end)|"
-            "(global|extern|byte|word)\\s+(" REGEX_CONTENT ")|"
-            "(equ|set)\\s+(" REGEX_SYM "),\\s*(" REGEX_CONTENT ")|"
-            "(align)\\s+(" REGEX_VAL_B ")\\s*(?:,\\s*(" REGEX_VAL_B "))?\\s*(?:,\\s*(" REGEX_VAL_B "))?|"
-            "(skip)\\s+(" REGEX_VAL_W ")\\s*(?:,\\s*(" REGEX_VAL_B "))?|"
-            ")"
-            REGEX_END
-        },
-        zeroaddr_str = {
-            REGEX_START
-            "(nop|halt|ret|iret)"
-            REGEX_END
-        },
-        oneaddr_str = {
-            REGEX_START
-            "(?:"
-            "(int)()\\s+(" REGEX_ADR_IMM_B ")|"
-
-            "(not)(b)\\s+(" REGEX_ADR_REGMEM_B ")|"
-            "(not)(w?)\\s+(" REGEX_ADR_REGMEM_W ")|"
-
-            "(pushf)()|" // pushf <=> push psw (push psw is not allowed but it is coded)
-            "(popf)()|"  // popf <=> pop psw (pop psw is not allowed but it is coded)
-
-            "(push)(b)\\s+(" REGEX_ADR_IMMREG_B "|" REGEX_ADR_MEM ")|"
-            "(push)(w?)\\s+(" REGEX_ADR_IMMREG_W "|" REGEX_ADR_MEM ")|"
-            "(pop)(b)\\s+(" REGEX_ADR_REGMEM_B ")|"
-            "(pop)(w?)\\s+(" REGEX_ADR_REGMEM_W ")|"
-
-            "(jmp|jeq|jne|jgt|call)()\\s+(" REGEX_ADR_MEM ")"
-            ")"
-            REGEX_END
-        },
-        twoaddr_str = {
-            REGEX_START
-            "(?:"
-            "(xchg)(b)\\s+(" REGEX_ADR_REGMEM_B ")\\s*,\\s*(" REGEX_ADR_REGDIR_B ")|"
-            "(xchg)(b)\\s+(" REGEX_ADR_REGDIR_B ")\\s*,\\s*(" REGEX_ADR_REGMEM_B ")|"
-            "(xchg)(w?)\\s+(" REGEX_ADR_REGMEM_W ")\\s*,\\s*(" REGEX_ADR_REGDIR_W ")|"
-            "(xchg)(w?)\\s+(" REGEX_ADR_REGDIR_W ")\\s*,\\s*(" REGEX_ADR_REGMEM_W ")|"
-
-            "(mov|add|sub|mul|div|cmp|and|or|xor|test)(b)\\s+(" REGEX_ADR_REGMEM_B ")\\s*,\\s*(" REGEX_ADR_IMMREG_B ")|"
-            "(mov|add|sub|mul|div|cmp|and|or|xor|test)(b)\\s+(" REGEX_ADR_REGDIR_B ")\\s*,\\s*(" REGEX_ADR_REGMEM_B ")|"
-            "(mov|add|sub|mul|div|cmp|and|or|xor|test)(w?)\\s+(" REGEX_ADR_REGMEM_W ")\\s*,\\s*(" REGEX_ADR_IMMREG_W ")|"
-            "(mov|add|sub|mul|div|cmp|and|or|xor|test)(w?)\\s+(" REGEX_ADR_REGDIR_W ")\\s*,\\s*(" REGEX_ADR_REGMEM_W ")|"
-
-            "(shl|shr)(b)\\s+(" REGEX_ADR_REGMEM_B ")\\s*,\\s*(" REGEX_ADR_IMMREG_B ")|"
-            "(shl|shr)(w?)\\s+(" REGEX_ADR_REGMEM_W ")\\s*,\\s*(" REGEX_ADR_IMMREG_W ")"
-            ")"
-            REGEX_END
-        },
-        expr_str = "^(\\s*(" REGEX_VAL_W "|" REGEX_SYM "|\\(|\\)|\\+|-|\\*|/|%|&|\\^)).*$";
+    Lexer() {};
+    Lexer(const Lexer &) = delete;
+    Lexer &operator=(const Lexer &) = delete;
 };
 
 #endif // lexer.h
\ No newline at end of file
@@ -0,0 +1,41 @@
+#ifndef _LINE_INDEX_H
+#define _LINE_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// *** Line index of a source buffer ***
+//
+// The buffer is split on '\n' the same way getline does: n newlines give n + 1
+// lines, the last one possibly empty. For every line the scan also records the
+// first non-whitespace character and the first comment character ([@#;]), so
+// blank and comment-only lines are recognized without running the lexer, and
+// content lines are handed to it without the leading whitespace and comment.
+// A '\r' before the '\n' is ordinary whitespace.
+//
+// The scan runs over 32-byte (AVX2) or 16-byte (SSE2) blocks when the CPU
+// supports it, and falls back to a scalar loop otherwise. A specific scan can
+// be requested (tests compare the vector scans against the scalar one); it is
+// lowered to the best one the CPU supports.
+
+struct Line_Scan { enum { Auto = 0, Scalar, SSE2, AVX2 }; };
+
+typedef struct Line_Span
+{
+    uint32_t begin;     // Offset of the first character of the line
+    uint32_t end;       // Offset one past the last character ('\n' excluded)
+    uint32_t content;   // Offset of the first non-whitespace character (or end)
+    uint32_t comment;   // Offset of the first comment character (or end)
+    bool blank() const { return content == comment; }
+} Line_Span;
+
+typedef std::vector<Line_Span> line_index_t;
+
+// Buffers must be shorter than 4 GiB (offsets are 32-bit)
+void index_lines(const char *buf, size_t len, line_index_t &lines, int scan = Line_Scan::Auto);
+
+// Best scan the CPU supports (Line_Scan::Scalar on non-x86 targets)
+int line_scan_supported();
+
+#endif // line_index.h
\ No newline at end of file
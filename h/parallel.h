@@ -0,0 +1,17 @@
+#ifndef _PARALLEL_H
+#define _PARALLEL_H
+
+#include <functional>
+#include <stddef.h>
+
+// *** Work-stealing parallel loop ***
+//
+// Runs body(i) for every i in [0, count) on the given number of threads, the
+// calling thread being one of them. Every thread starts with a contiguous range
+// of indices and takes them from its front. A thread whose range runs out steals
+// the back half of the largest range left, so a few long iterations do not
+// leave the other threads idle. Returns when all iterations are done.
+
+void parallel_for(unsigned threads, size_t count, const std::function<void(size_t)> &body);
+
+#endif // parallel.h
\ No newline at end of file
@@ -2,8 +2,9 @@
 #define _PARSER_H
 
 #include "lexer.h"
+#include "string_pool.h"
 
-#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -13,12 +14,16 @@
 
 struct Content_Type { enum { None = 0, Directive, Instruction }; };
 struct Operand_Size { enum { None = 0, Byte, Word }; };
+struct Operand_Type { enum { None = 0, Imm, ImmSym, RegDir, RegInd, RegIndOff8, RegIndOff16, RegIndSym, MemSym, PcRelSym, MemAbs }; };
+
+// *** Parsed line ***
+// Tokens are views into the parsed string, the assembler keeps what it needs.
 
 typedef struct Directive
 {
     enum { Global = 0, Extern, Equ, Set, Text, Data, Bss, Section, End, Byte, Word, Align, Skip };
     uint8_t code;
-    std::string p1, p2, p3;
+    Token p1, p2, p3;
 } Directive;
 
 typedef struct Instruction
@@ -27,114 +32,79 @@ typedef struct Instruction
     uint8_t code;
     uint8_t op_size;
     uint8_t op_cnt;
-    std::string op1, op2;
+    Token op1, op2;
 } Instruction;
 
-class Expression_Token
-{
-public:
-    enum Token_Type { Operator, Number, Symbol };
-    const Token_Type type;
-    Expression_Token(const Expression_Token &t);
-    Expression_Token(Token_Type type);
-    virtual ~Expression_Token() {}
-};
-
-class Operator_Token : public Expression_Token
+class Operator_Token
 {
 public:
     enum Operator_Type { Open, Close, Add, Sub, Mul, Div, Mod, And, Or, Xor };
-    const Operator_Type op_type;
+    Operator_Type op_type;
 
-    Operator_Token(const Operator_Token &t);
     Operator_Token(Operator_Type op_type);
 
     char get_symbol();
     int priority();
+    bool divides();
     int calculate(unsigned a, unsigned b);
     int get_st_shndx(int shndx_a, int shndx_b);
     int get_clidx(int clidx_a, int clidx_b);
 };
 
-class Number_Token : public Expression_Token
-{
-public:
-    const int value;
-    Number_Token(const Number_Token &t);
-    Number_Token(int value);
-};
-
-class Symbol_Token : public Expression_Token
-{
-public:
-    std::string name;
-    Symbol_Token(const Symbol_Token &t);
-    Symbol_Token(const std::string &name);
-};
-
-typedef std::vector<std::unique_ptr<Expression_Token>> Expression;
+// *** Compiled expressions ***
+// Expressions are compiled once into a postfix program. Operators are binary
+// and left-associative, subexpressions made only of numbers are folded at
+// compile time. Neither the operand stack nor the operator stack may grow
+// deeper than EXPR_STACK_MAX, so the evaluator can use fixed arrays.
 
-class Parser;
+#define EXPR_STACK_MAX 32
 
-class Line
+typedef struct Expression_Op
 {
-public:
-    std::string label;
-    uint8_t content_type;
+    enum { Number = Operator_Token::Xor + 1, Symbol };
+    uint8_t code;   // Operator_Token::Operator_Type (Add to Xor), Number or Symbol
+    int     value;  // Number value or index into Expression::symbols
+} Expression_Op;
 
-    Line();
-    Line(const Line &);
-    ~Line();
-
-    Directive& getDir();
-    Instruction& getInstr();
-protected:
-    friend class Parser;
+typedef struct Expression
+{
+    std::vector<Expression_Op>  code;       // Postfix program
+    std::vector<str_id_t>       symbols;    // Symbol operands in source order
+} Expression;
 
-    void freeDir();
-    void freeInstr();
-private:
-    Directive *dir;
-    Instruction *instr;
-};
+typedef struct Line
+{
+    Token       label;
+    uint8_t     content_type;
+    Directive   dir;
+    Instruction instr;
+} Line;
 
 class Parser
 {
 public:
-    Parser(Lexer *lexer);
-    ~Parser() {};
+    // Keyword tables are built at compile time and the parser keeps no state of
+    // its own, so every Assembler uses the same process-wide instance
+    static const Parser &shared();
 
     std::string get_directive(uint8_t code) const;
     std::string get_instruction(uint8_t code) const;
 
-    bool parse_line(const std::string &str, Line &result);
-    bool parse_directive(const std::string &str, Directive &result);
-    bool parse_instruction(const std::string &str, Instruction &result);
-    bool parse_expression(const std::string &str, Expression &result);
+    bool parse_line(const Token &str, Line &result, std::string &error) const;
+    bool parse_directive(const Token &str, Directive &result) const;
+    bool parse_instruction(const Token &str, Instruction &result, std::string &error) const;
+    bool parse_expression(const Token &str, Expression &result, String_Pool &strings) const;
 
-    int decode_number(const std::string &str);
-    bool decode_byte(const std::string &str, uint8_t &result);
-    bool decode_word(const std::string &str, uint16_t &result);
-    bool decode_register(const std::string &str, uint8_t &regdesc);
+    int decode_number(const Token &str) const;
+    bool decode_byte(const Token &str, uint8_t &result) const;
+    bool decode_word(const Token &str, uint16_t &result) const;
+    bool decode_register(const Token &str, uint8_t &regdesc) const;
 private:
-    Lexer *lexer;
-
-    const std::string dir_str[DIR_CNT] = {
-        "global", "extern", "equ", "set", "text", "data", "bss",
-        "section", "end", "byte", "word", "align", "skip"
-    };
-
-    const std::string instr_str[INSTR_CNT] = {
-        "nop", "halt", "xchg", "int", "mov", "add", "sub", "mul", "div",
-        "cmp", "not", "and", "or", "xor", "test", "shl", "shr", "push",
-        "pop", "jmp", "jeq", "jne", "jgt", "call", "ret", "iret"
-    };
-
-    const std::string pseudo_str[PSEUDO_CNT] = {
-        "pushf", "popf"
-    };
+    const Lexer *lexer;
 
-    std::map<std::string, uint8_t>  dir_map, instr_map, pseudo_map;
+    Parser(const Lexer *lexer);
+    Parser(const Parser &) = delete;
+    Parser &operator=(const Parser &) = delete;
 };
 
 #endif // parser.h
\ No newline at end of file
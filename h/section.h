@@ -0,0 +1,96 @@
+#ifndef _SECTION_H
+#define _SECTION_H
+
+#include "elf.h"
+#include "string_pool.h"
+
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+typedef struct Shdrtab_Entry
+{
+    Elf16_Addr index;   // Section header table index, also the section name's index
+    Elf16_Shdr shdr;
+    Shdrtab_Entry();
+    Shdrtab_Entry(Elf16_Addr index, Elf16_Word type, Elf16_Word flags, Elf16_Word info = 0, Elf16_Word entsize = 0, Elf16_Word size = 0);
+} Shdrtab_Entry;
+
+typedef struct Reltab_Entry
+{
+    Elf16_Rel   rel;
+    Reltab_Entry(Elf16_Word info, Elf16_Addr offset = 0);
+} Reltab_Entry;
+
+// *** Section contents ***
+//
+// Bytes are appended into fixed-size chunks, a full chunk is never reallocated
+// or copied. Appending is a pointer compare and a store. Fills (.skip, .align)
+// are kept as spans of a repeated byte and only expanded by copy_to(). Pushed
+// bytes are read with get() and overwritten in place with patch(), at offsets
+// counted by stored(). append() pushes and fills the contents of another buffer.
+
+#define SECTION_CHUNK_BITS  10
+#define SECTION_CHUNK       (1u << SECTION_CHUNK_BITS)
+
+typedef struct Fill_Span
+{
+    uint32_t    offset; // Offset in the section
+    uint32_t    size;
+    Elf16_Half  byte;
+} Fill_Span;
+
+class Section_Buffer
+{
+public:
+    Section_Buffer() : pos(nullptr), end(nullptr), filled(0) {}
+
+    void push(Elf16_Half byte)
+    {
+        if (pos == end) grow();
+        *pos++ = byte;
+    }
+    void fill(Elf16_Half byte, size_t count);
+    void append(const Section_Buffer &other);
+    void patch(size_t at, Elf16_Half byte) { chunks[at >> SECTION_CHUNK_BITS][at & (SECTION_CHUNK - 1)] = byte; }
+    Elf16_Half get(size_t at) const { return chunks[at >> SECTION_CHUNK_BITS][at & (SECTION_CHUNK - 1)]; }
+
+    size_t stored() const { return chunks.empty() ? 0 : (chunks.size() - 1) * SECTION_CHUNK + (pos - chunks.back().get()); } // bytes pushed
+    size_t size() const { return stored() + filled; }
+    void copy_to(Elf16_Half *dst) const; // writes size() bytes
+
+private:
+    std::vector<std::unique_ptr<Elf16_Half[]>>  chunks;
+    Elf16_Half                                  *pos, *end; // free space of the last chunk
+    std::vector<Fill_Span>                      fills;
+    size_t                                      filled;     // total size of fills
+
+    void copy_stored(size_t from, size_t count, Elf16_Half *dst) const;
+    void append_stored(const Section_Buffer &other, size_t from, size_t count);
+    void grow();
+};
+
+typedef Elf16_Section sect_handle_t;
+
+// *** Section ***
+//
+// A section is named by its handle, which is its section header table index.
+// The null section (handle 0) is current before the first section directive.
+
+#define LOC_CNT_MAX 0xffff // Sections are limited to 16-bit addresses
+
+typedef struct Section
+{
+    str_id_t        name;
+    Shdrtab_Entry   header;
+    Elf16_Addr      loc_cnt;    // Location counter, at most LOC_CNT_MAX
+    uint32_t        symbol;     // Symbol table index of the section symbol
+    sect_handle_t   rel;        // Relocation section, 0 until the first relocation
+    Section_Buffer  data;       // Contents (SHT_PROGBITS only)
+    std::vector<Reltab_Entry> relocs; // Entries (SHT_REL)
+
+    Section(str_id_t name, const Shdrtab_Entry &header);
+} Section;
+
+#endif // section.h
\ No newline at end of file
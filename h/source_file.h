@@ -0,0 +1,37 @@
+#ifndef _SOURCE_FILE_H
+#define _SOURCE_FILE_H
+
+#include <ostream>
+#include <stddef.h>
+#include <string>
+
+// *** Source file contents ***
+//
+// A regular file is mapped read-only and its text is never copied, lines and
+// tokens point straight into the mapping. Pipes, terminals and anything else
+// that cannot be mapped are read into memory instead. The contents stay valid
+// until the file is closed or another one is opened.
+
+class Source_File
+{
+public:
+    Source_File() : map(nullptr), len(0) {}
+    ~Source_File() { close(); }
+    Source_File(const Source_File &) = delete;
+    Source_File &operator=(const Source_File &) = delete;
+
+    bool open(const std::string &name, std::ostream &errors); // prints an error and returns false on failure
+    void close();
+
+    const char *data() const { return map != nullptr ? map : buffer.data(); }
+    size_t size() const { return len; }
+
+private:
+    const char  *map;   // mapping, or nullptr if the contents are in buffer
+    size_t      len;
+    std::string buffer;
+
+    bool read_all(int fd, const std::string &name, std::ostream &errors);
+};
+
+#endif // source_file.h
\ No newline at end of file
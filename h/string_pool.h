@@ -0,0 +1,38 @@
+#ifndef _STRING_POOL_H
+#define _STRING_POOL_H
+
+#include "lexer.h"
+
+#include <deque>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+typedef uint32_t str_id_t;
+
+// *** Interned strings ***
+//
+// Every distinct string is stored once and named by a 32-bit id, id 0 is the
+// empty string. Stored strings never move, so references returned by get()
+// stay valid for the lifetime of the pool. Lookup is an open-addressing hash
+// table of ids (linear probing, kept at most half full).
+
+class String_Pool
+{
+public:
+    String_Pool();
+
+    str_id_t intern(const Token &str);
+    const std::string &get(str_id_t id) const { return strings[id]; }
+    size_t size() const { return strings.size(); }
+
+private:
+    std::deque<std::string> strings;    // by id
+    std::vector<uint32_t>   hashes;     // by id
+    std::vector<str_id_t>   slots;      // 0 = empty slot
+
+    static uint32_t hash(const Token &str);
+    void grow();
+};
+
+#endif // string_pool.h
\ No newline at end of file
@@ -0,0 +1,65 @@
+#ifndef _SYMBOL_TABLE_H
+#define _SYMBOL_TABLE_H
+
+#include "elf.h"
+#include "string_pool.h"
+
+#include <deque>
+#include <stdint.h>
+#include <vector>
+
+// Symbol table indices are 16-bit, relocations can only refer to the first
+// ELF16_R_SYM_MAX + 1 symbols
+#define SYMTAB_MAX 0xffff
+
+typedef uint32_t sym_handle_t;
+
+typedef struct Symtab_Entry
+{
+    sym_handle_t index; // Symbol table index, set by Symbol_Table::insert
+    Elf16_Sym sym;
+    bool is_equ;        // Specifies whether the symbol is defined by .equ directive
+                        // If this is true and the sym.st_shndx is SHN_UNDEF, the value is
+                        // relocatable and every use is expanded from equ_expansions[expansion]
+    uint32_t expansion; // Index in Assembler::equ_expansions, 0 if none (yet)
+    Symtab_Entry();
+    Symtab_Entry(Elf16_Word name, Elf16_Addr value, uint8_t info, Elf16_Section shndx, bool is_equ = false);
+} Symtab_Entry;
+
+// *** Symbol table ***
+//
+// Symbols are keyed by their interned name and live in insertion order, which
+// is also their symbol table index. A handle is that position: entries never
+// move and are never removed, so handles and entry references stay valid.
+// Lookup is an open-addressing hash table of (name, handle) pairs (linear
+// probing, kept at most half full), so a probe touches a single flat array.
+
+class Symbol_Table
+{
+public:
+    Symbol_Table();
+
+    Symtab_Entry *find(str_id_t name);
+    Symtab_Entry &insert(str_id_t name, const Symtab_Entry &entry); // name must not be in the table
+
+    Symtab_Entry &at(sym_handle_t handle) { return entries[handle]; }
+    str_id_t name(sym_handle_t handle) const { return names[handle]; }
+    size_t size() const { return entries.size(); }
+
+private:
+    typedef struct Slot
+    {
+        str_id_t        name;
+        sym_handle_t    handle; // SLOT_EMPTY if the slot is empty
+    } Slot;
+
+    std::deque<Symtab_Entry>    entries;    // by handle
+    std::vector<str_id_t>       names;      // by handle
+    std::vector<Slot>           slots;
+    unsigned                    bits;       // slots.size() == 1 << bits
+
+    size_t slot(str_id_t name) const { return (name * 2654435769u) >> (32 - bits); }
+    void grow();
+};
+
+#endif // symbol_table.h
\ No newline at end of file
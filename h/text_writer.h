@@ -0,0 +1,56 @@
+#ifndef _TEXT_WRITER_H
+#define _TEXT_WRITER_H
+
+#include <ostream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// *** Buffered text output ***
+//
+// Text is formatted straight into a fixed buffer, which is written to the file
+// whenever it fills up. Numbers are converted by hand, there is no stream state
+// to set or restore per field. Bytes are converted two hex digits at a time from
+// a lookup table, a row of them into a stack buffer first.
+
+#define TEXT_WRITER_BUFFER  (64 * 1024)
+
+class Text_Writer
+{
+public:
+    Text_Writer() : fd(-1), len(0), failed(false) {}
+    ~Text_Writer() { close(); }
+    Text_Writer(const Text_Writer &) = delete;
+    Text_Writer &operator=(const Text_Writer &) = delete;
+
+    bool open(const std::string &name, std::ostream &errors); // prints an error and returns false on failure
+    bool close();                       // flushes, false if any write failed
+
+    void put(char c)
+    {
+        if (len == TEXT_WRITER_BUFFER) flush();
+        buf[len++] = c;
+    }
+    void put(const char *str, size_t size);
+    void put(const char *str) { put(str, strlen(str)); }
+    void put(const std::string &str) { put(str.data(), str.size()); }
+    void put_hex(unsigned value, unsigned digits);      // lowercase, zero padded to digits
+    void put_hex_bytes(const uint8_t *bytes, size_t count); // two digits each, space separated
+    void put_dec(unsigned value, unsigned width = 0);   // right aligned, space padded to width
+    void put_dec_left(unsigned value, unsigned width);  // left aligned, space padded to width
+    void put_left(const char *str, size_t size, size_t width); // space padded to width
+    void put_left(const char *str, size_t width) { put_left(str, strlen(str), width); }
+    void put_left(const std::string &str, size_t width) { put_left(str.data(), str.size(), width); }
+    void pad(size_t count);                             // spaces
+
+private:
+    int     fd;
+    size_t  len;    // bytes in buf
+    bool    failed;
+    char    buf[TEXT_WRITER_BUFFER];
+
+    void flush();
+};
+
+#endif // text_writer.h
\ No newline at end of file
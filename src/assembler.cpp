@@ -1,409 +1,792 @@
 #include "assembler.h"
+#include "parallel.h"
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
-using std::cerr;
-using std::cout;
 using std::dec;
 using std::hex;
-using std::ifstream;
-using std::ios;
-using std::left;
 using std::map;
 using std::ostream;
 using std::pair;
 using std::right;
 using std::setfill;
 using std::setw;
-using std::stack;
 using std::string;
 using std::unique_ptr;
 using std::vector;
 
-Line_Info::Line_Info() {}
-Line_Info::Line_Info(unsigned line_num, Elf16_Addr loc_cnt, Line line) : line_num(line_num), loc_cnt(loc_cnt), line(line) {}
-
-Symtab_Entry::Symtab_Entry() {};
-
-Symtab_Entry::Symtab_Entry(Elf16_Word name, Elf16_Addr value, uint8_t info, Elf16_Section shndx, bool is_equ)
-    : index(symtab_index++), is_equ(is_equ)
-{
-    sym.st_name     = name;     // String table index
-    sym.st_value    = value;    // Symbol value
-    sym.st_size     = 0;        // Symbol size
-    sym.st_info     = info;     // Symbol type and binding
-    sym.st_other    = 0;        // No defined meaning, 0
-    sym.st_shndx    = shndx;    // Section header table index
-}
-
-Elf16_Addr Symtab_Entry::symtab_index   = 0;
-
-Shdrtab_Entry::Shdrtab_Entry() {};
-
-Shdrtab_Entry::Shdrtab_Entry(Elf16_Word type, Elf16_Word flags, Elf16_Word info, Elf16_Word entsize, Elf16_Word size)
-    : index(shdrtab_index++)
-{
-    shdr.sh_name        = index;    // Section header string table index
-    shdr.sh_type        = type;     // Section type
-    shdr.sh_flags       = flags;    // Section flags
-    shdr.sh_addr        = 0;        // Section virtual address
-    shdr.sh_offset      = 0;        // Section file offset
-    shdr.sh_size        = size;     // Section size in bytes
-    shdr.sh_link        = 0;        // Link to another section
-    shdr.sh_info        = info;     // Additional section information
-    shdr.sh_addralign   = 0;        // Section alignment (0 | 1 = no alignment, 2^n = alignment)
-    shdr.sh_entsize     = entsize;  // Entry size if section holds table
-}
-
-Elf16_Addr Shdrtab_Entry::shdrtab_index = 0;
-
-Reltab_Entry::Reltab_Entry(Elf16_Word info, Elf16_Addr offset)
-{
-    rel.r_offset = offset;
-    rel.r_info = info;
-}
+Line_Info::Line_Info(uint32_t line_num, Elf16_Addr loc_cnt)
+    : line_num(line_num), label(0), loc_cnt(loc_cnt), content_type(Content_Type::None), code(0), op_size(0), op_cnt(0), op_mode(), dir() {}
 
-Assembler::Assembler(const string &input_file, const string &output_file, bool binary)
+Assembler::Assembler(const string &input_file, const string &output_file, const Assembler_Options &options, ostream &messages, ostream &errors)
+    : messages(messages), errors(errors)
 {
     this->input_file    = input_file;
     this->output_file   = output_file;
-    this->binary        = binary;
+    this->options       = options;
 
-    // Initializing lexer and parser
-    lexer   = new Lexer();
-    parser  = new Parser(lexer);
-
-    // Initializing variables
-    cur_sect.name           = "";
-    cur_sect.type           = SHT_NULL;
-    cur_sect.flags          = 0;
-    cur_sect.loc_cnt        = 0;
-    cur_sect.shdrtab_index  = 0;
+    // Lexer and parser are immutable and shared by all assemblers
+    lexer   = &Lexer::shared();
+    parser  = &Parser::shared();
 
     // Inserting a dummy symbol
     Symtab_Entry dummySym(0, 0, ELF16_ST_INFO(STB_LOCAL, STT_NOTYPE), SHN_UNDEF);
-    symtab_map.insert(symtab_pair_t("", dummySym));
+    symtab.insert(0, dummySym);
     strtab_vect.push_back("");
+    equ_expansions.emplace_back();
 
-    // Inserting a dummy section header
-    Shdrtab_Entry dummyShdr(SHT_NULL, 0, 0);
-    shdrtab_map.insert(shdrtab_pair_t("", dummyShdr));
-    shstrtab_vect.push_back("");
-}
-
-Assembler::~Assembler()
-{
-    delete(parser);
-    delete(lexer);
-    if (input.is_open())
-        input.close();
-    if (output.is_open())
-        output.close();
+    // Inserting a dummy section header, current until the first section directive
+    sections.emplace_back(0, Shdrtab_Entry(0, SHT_NULL, 0, 0));
+    cur_sect = &sections[0];
 }
 
 bool Assembler::assemble()
 {
     if (!run_first_pass())
     {
-        cerr << "ERROR: Assembler failed to complete first pass!\n";
+        errors << "ERROR: Assembler failed to complete first pass!\n";
         return false;
     }
 
-    cur_sect.name = "";
-    cur_sect.type = SHT_NULL;
-    cur_sect.flags = 0;
-    cur_sect.loc_cnt = 0;
-    cur_sect.shdrtab_index = 0;
-    lc_map.clear();
+    cur_sect = &sections[0];
 
     if (!evaluate_expressions()) return false;
 
-    if (!run_second_pass())
+    if (options.single_pass)
+    {
+        if (!apply_fixups())
+        {
+            errors << "ERROR: Assembler failed to apply fixups!\n";
+            return false;
+        }
+    }
+    else if (!run_second_pass())
     {
-        cerr << "ERROR: Assembler failed to complete second pass!\n";
+        errors << "ERROR: Assembler failed to complete second pass!\n";
         return false;
     }
 
-    finalize();
-    write_output();
+    if (!finalize()) return false;
+    if (!write_output())
+    {
+        errors << "ERROR: Failed to write output file: '" << output_file << "'!\n";
+        return false;
+    }
+    if (!options.listing_file.empty() && !write_listing())
+    {
+        errors << "ERROR: Failed to write listing file: '" << options.listing_file << "'!\n";
+        return false;
+    }
 
     return true;
 }
 
+// *** Parallel parsing ***
+// Parsing a line depends on nothing but its text, so the first pass parses
+// the lines a batch ahead, split into chunks over the worker threads. Storing,
+// sizing and processing the parsed lines stays sequential, in line order. A
+// batch is a few chunks per thread, small enough to be read back from cache.
+
+#define PARSE_CHUNK_LINES   1024
+#define PARSE_BATCH_CHUNKS  4       // per thread
+
 bool Assembler::run_first_pass()
 {
     pass = Pass::First;
     bool res = true;
-    string line_str;
-    Line_Info info;
+    bool echo = options.verbosity == Verbosity::Verbose;
+
+    if (echo) messages << ">>> FIRST PASS <<<\n\n";
 
-    cout << ">>> FIRST PASS <<<\n\n";
+    if (!read_input()) return false;
 
-    if (input.is_open())
-        input.close();
-    input.open(input_file, ifstream::in);
+    vector<Parsed_Line> batch(std::min<size_t>(line_index.size(), (size_t) options.threads * PARSE_BATCH_CHUNKS * PARSE_CHUNK_LINES));
+    uint32_t batch_begin = 1, batch_end = 1; // Line numbers parsed into batch
+    auto parse = [this, &batch, &batch_begin, &batch_end](size_t chunk)
+    {
+        uint32_t first = batch_begin + chunk * PARSE_CHUNK_LINES;
+        std::ostream discard(nullptr); // Operand errors are reported by process_instruction()
+        for (uint32_t line_num = first; line_num < batch_end && line_num < first + PARSE_CHUNK_LINES; ++line_num)
+        {
+            const Line_Span &span = line_index[line_num - 1];
+            if (!span.blank()) parse_line(batch[line_num - batch_begin], span, discard);
+        }
+    };
 
-    for (file_idx = 0, info.line_num = 1; !input.eof(); ++info.line_num)
+    file_vect.reserve(line_index.size() + 1);
+    for (uint32_t line_num = 1; line_num <= line_index.size(); ++line_num)
     {
-        getline(input, line_str);
-        cout << info.line_num << ":\t" << line_str << '\n';
-        if (parser->parse_line(line_str, info.line))
+        if (line_num == batch_end)
+        {
+            batch_begin = line_num;
+            batch_end = std::min<size_t>(line_num + batch.size(), line_index.size() + 1);
+            parallel_for(options.threads, (batch_end - batch_begin + PARSE_CHUNK_LINES - 1) / PARSE_CHUNK_LINES, parse);
+        }
+        const Line_Span &span = line_index[line_num - 1];
+        bool eof = line_num == line_index.size();
+        if (echo)
+        {
+            messages << line_num << ":\t";
+            messages.write(source.data() + span.begin, span.end - span.begin) << '\n';
+        }
+        if (span.blank()) continue; // Empty or comment-only line
+        const Parsed_Line &parsed = batch[line_num - batch_begin];
+        const Line &line = parsed.line;
+        if (parsed.ok)
         {
-            Result tmp = process_line(info);
-            if (tmp == Result::Empty) continue;
-            if (tmp == Result::Success && !input.eof())
+            if (line.label.empty() && line.content_type == Content_Type::None) continue; // Skip empty line
+            file_idx = file_vect.size();
+            file_vect.emplace_back(line_num, cur_sect->loc_cnt);
+            store_line(parsed, file_vect.back());
+            Result tmp = process_line(file_vect.back());
+            if (options.single_pass && tmp != Result::Error)
             {
-                file_idx++;
-                continue;
+                sect_handle_t sect = cur_sect->header.index;
+                size_t pos = cur_sect->data.stored();
+                if (!emit_line(file_vect.back())) tmp = Result::Error;
+                else list_line(sect, pos);
             }
+            if (tmp == Result::Success && !eof) continue;
             if (tmp == Result::Error)
             {
-                cerr << "ERROR: Failed to process line: " << info.line_num << "!\n";
+                errors << "ERROR: Failed to process line: " << line_num << "!\n";
                 res = false;
                 break;
             }
-            cout << "End of file reached at line: " << info.line_num << "!\n";
+            if (echo) messages << "End of file reached at line: " << line_num << "!\n";
             break;
         }
         else
         {
-            cerr << "ERROR: Failed to parse line: " << info.line_num << "!\n";
+            if (!parsed.error.empty()) errors << "ERROR: " << parsed.error << "!\n";
+            errors << "ERROR: Failed to parse line: " << line_num << "!\n";
             res = false;
             break;
         }
     }
     // Adding an empty line for storing next_instr lc for the last instruction (line)
-    file_vect.push_back(Line_Info(0, cur_sect.loc_cnt, Line()));
+    file_vect.emplace_back(0, cur_sect->loc_cnt);
 
-    input.close();
     return res;
 }
 
+bool Assembler::read_input()
+{
+    if (!source.open(input_file, errors)) return false;
+    index_lines(source.data(), source.size(), line_index);
+    return true;
+}
+
 bool Assembler::run_second_pass()
 {
     pass = Pass::Second;
     bool res = true;
+    bool echo = options.verbosity == Verbosity::Verbose;
 
-    cout << "\n>>> SECOND PASS <<<\n\n";
+    if (echo) messages << "\n>>> SECOND PASS <<<\n\n";
+    else if (options.threads > 1) return run_parallel_second_pass(); // echo keeps the lines in order
 
     for (file_idx = 0; file_idx < file_vect.size() - 1; ++file_idx)
     {
-        print_line(file_vect[file_idx]);
+        if (echo) print_line(file_vect[file_idx]);
+        sect_handle_t sect = cur_sect->header.index;
+        size_t pos = cur_sect->data.stored();
         Result tmp = process_line(file_vect[file_idx]);
+        list_line(sect, pos);
         if (tmp == Result::Success && file_idx + 1 < file_vect.size() - 1) continue;
         if (tmp == Result::Error)
         {
-            cerr << "ERROR: Failed to process line: " << file_vect[file_idx].line_num << "!\n";
+            errors << "ERROR: Failed to process line: " << file_vect[file_idx].line_num << "!\n";
             res = false;
             break;
         }
-        cout << "End of file reached at line: " << file_vect[file_idx].line_num << "!\n";
+        if (echo) messages << "End of file reached at line: " << file_vect[file_idx].line_num << "!\n";
         break;
     }
 
     return res;
 }
 
-bool Assembler::evaluate_expressions()
+// Lines the second pass has to process in order: they switch sections, make
+// symbols global or end the file. All other lines are only encoded.
+
+static bool is_sequential(const Line_Info &info)
+{
+    if (info.content_type != Content_Type::Directive) return false;
+    switch (info.code)
+    {
+    case Directive::Global:
+    case Directive::Text:
+    case Directive::Data:
+    case Directive::Bss:
+    case Directive::Section:
+    case Directive::End:
+        return true;
+    default: return false;
+    }
+}
+
+// *** Parallel second pass ***
+// The lines between two sequential lines are cut into chunks, which are encoded
+// on the worker threads into buffers of their own. The chunks are then appended
+// to their sections in line order, so relocation sections are created and
+// filled in the same order as by the sequential pass. Chunks are encoded before
+// a .global line is processed, as it changes how later lines are relocated.
+
+#define ENCODE_CHUNK_LINES  1024
+
+typedef struct Encode_Chunk
 {
-    Result res;
-    int value;
-    bool changes = true;
-    while (changes)
+    sect_handle_t               sect;
+    uint32_t                    begin, end;     // Lines (indices in file_vect)
+    uint32_t                    failed;         // Line that failed to encode, UINT32_MAX if none
+    Section_Buffer              data;
+    vector<Reltab_Entry>        relocs;
+    vector<Listing_Entry>       listing;        // Only with a listing file, pos relative to data
+    std::ostringstream          errors;
+    Encode_Chunk(sect_handle_t sect, uint32_t begin) : sect(sect), begin(begin), end(begin), failed(UINT32_MAX) {}
+} Encode_Chunk;
+
+bool Assembler::run_parallel_second_pass()
+{
+    std::deque<Encode_Chunk> chunks;
+    bool list = !options.listing_file.empty();
+
+    auto encode = [this, &chunks, list](size_t i)
+    {
+        Encode_Chunk &chunk = chunks[i];
+        Encoder enc(sections[chunk.sect], chunk.errors);
+        enc.data = &chunk.data;
+        enc.relocs = &chunk.relocs;
+        for (uint32_t line = chunk.begin; line < chunk.end; ++line)
+        {
+            size_t pos = chunk.data.stored();
+            if (encode_line(enc, line) == Result::Error)
+            {
+                chunk.failed = line;
+                return;
+            }
+            if (list) chunk.listing.push_back({ line, chunk.sect, (uint32_t) pos, (uint32_t) (chunk.data.stored() - pos) });
+        }
+    };
+    auto flush = [this, &chunks, &encode]() -> bool
     {
-        changes = false;
-        for (auto it = equ_uneval_map.begin(); it != equ_uneval_map.end(); ++it)
+        parallel_for(options.threads, chunks.size(), encode);
+        for (Encode_Chunk &chunk : chunks)
         {
-            res = process_expression(*(it->second), value, true, it->first);
-            if (res == Result::Error)
+            Section &sect = sections[chunk.sect];
+            errors << chunk.errors.str();
+            if (chunk.failed != UINT32_MAX)
             {
-                cerr << "ERROR: Failed to evaluate expression for .equ symbol '" << it->first << "'!\n";
+                errors << "ERROR: Failed to process line: " << file_vect[chunk.failed].line_num << "!\n";
                 return false;
             }
-            if (res == Result::Success)
+            for (Listing_Entry &entry : chunk.listing)
             {
-                if (symtab_map.count(it->first) == 0)
-                {   // should never happen
-                    cerr << "ERROR: Assembler error: Unevaluated .equ symbol '" << it->first << "' is undefined!\n";
-                    return false;
-                }
-                Symtab_Entry &entry = symtab_map.at(it->first);
-                entry.sym.st_shndx = SHN_ABS;
-                entry.sym.st_value = value;
+                entry.pos += sect.data.stored();
+                listing.push_back(entry);
+            }
+            sect.data.append(chunk.data);
+            if (!chunk.relocs.empty())
+            {
+                vector<Reltab_Entry> &relocs = rel_section(sect).relocs;
+                relocs.insert(relocs.end(), chunk.relocs.begin(), chunk.relocs.end());
             }
-            changes = true;
-            equ_uneval_map.erase(it->first);
+        }
+        chunks.clear();
+        return true;
+    };
+
+    for (file_idx = 0; file_idx < file_vect.size() - 1; ++file_idx)
+    {
+        const Line_Info &info = file_vect[file_idx];
+        if (!is_sequential(info))
+        {
+            if (chunks.empty() || chunks.back().end != file_idx || chunks.back().end - chunks.back().begin == ENCODE_CHUNK_LINES)
+                chunks.emplace_back(cur_sect->header.index, file_idx);
+            chunks.back().end++;
+            continue;
+        }
+        if (info.code == Directive::Global && !flush()) return false;
+        list_line(cur_sect->header.index, cur_sect->data.stored());
+        Result tmp = process_line(file_vect[file_idx]);
+        if (tmp == Result::Error)
+        {
+            errors << "ERROR: Failed to process line: " << info.line_num << "!\n";
+            return false;
+        }
+        if (tmp == Result::End) break;
+    }
+    if (!flush()) return false;
+
+    std::sort(listing.begin(), listing.end(), [](const Listing_Entry &a, const Listing_Entry &b) { return a.line < b.line; });
+    return true;
+}
+
+// *** Single-pass mode ***
+// Each line is encoded right after the first pass sized it, unless it uses a
+// symbol. Those lines get zeroed bytes and a fixup, and .global lines a fixup
+// only. Fixups are applied in line order once all .equ symbols are evaluated,
+// so relocations come out in the same order as from the second pass.
+
+bool Assembler::emit_line(Line_Info &info)
+{
+    bool deferred = false;
+    if (info.content_type == Content_Type::Instruction)
+    {
+        for (unsigned i = 0; i < info.op_cnt; ++i)
+        {
+            uint8_t type = info.op_type(i);
+            if (type == Operand_Type::ImmSym || type == Operand_Type::RegIndSym || type == Operand_Type::PcRelSym || type == Operand_Type::MemSym)
+                deferred = true;
+        }
+    }
+    else if (info.content_type == Content_Type::Directive)
+    {
+        switch (info.code)
+        {
+        case Directive::Byte:
+        case Directive::Word:
+            for (size_t i = info.dir.expr; i < data_exprs.size(); ++i)
+                if (!data_exprs[i].symbols.empty()) deferred = true;
             break;
+        case Directive::Align:
+        case Directive::Skip:
+            break;
+        case Directive::Global:
+            fixups.push_back({ file_idx, cur_sect->header.index, 0 });
+            return true;
+        default: return true; // Nothing to encode
         }
     }
-    if (equ_uneval_map.empty()) return true;
-    return false;
+    else return true; // Label only
+
+    Elf16_Addr end = cur_sect->loc_cnt;
+    if (deferred)
+    {
+        fixups.push_back({ file_idx, cur_sect->header.index, (uint32_t) cur_sect->data.stored() });
+        if (cur_sect->header.shdr.sh_type == SHT_PROGBITS)
+            for (Elf16_Addr n = end - info.loc_cnt; n > 0; --n) cur_sect->data.push(0);
+        return true;
+    }
+    Encoder enc(*cur_sect, errors);
+    return encode_line(enc, file_idx) != Result::Error;
+}
+
+bool Assembler::apply_fixups()
+{
+    pass = Pass::Second;
+    for (const Fixup &fixup : fixups)
+    {
+        file_idx = fixup.line;
+        Result tmp;
+        if (is_sequential(file_vect[file_idx])) tmp = process_line(file_vect[file_idx]);
+        else
+        {
+            Encoder enc(sections[fixup.sect], errors);
+            enc.patch_pos = fixup.pos;
+            tmp = encode_line(enc, file_idx);
+        }
+        if (tmp == Result::Error)
+        {
+            errors << "ERROR: Failed to process line: " << file_vect[file_idx].line_num << "!\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// *** .equ resolution ***
+// The .equ symbols left unevaluated by the first pass form a dependency graph,
+// with an edge for every unevaluated .equ symbol used in an expression.
+// Tarjan's algorithm yields its strongly connected components dependencies
+// first, so every symbol is evaluated once, after all the symbols it uses.
+// A component of more than one symbol, or a symbol that uses itself, is a
+// circular definition, reported with all of its symbols.
+
+bool Assembler::evaluate_expressions()
+{
+    const unsigned none = UINT32_MAX;
+
+    // Build the graph, edges of node i are edges[edge_begin[i] .. edge_begin[i + 1])
+    vector<str_id_t> names;
+    vector<const Expression *> exprs;
+    std::unordered_map<str_id_t, unsigned> node_of;
+    for (auto it = equ_uneval_map.begin(); it != equ_uneval_map.end(); ++it)
+    {
+        node_of.emplace(it->first, names.size());
+        names.push_back(it->first);
+        exprs.push_back(it->second.get());
+    }
+    unsigned n = names.size();
+    vector<unsigned> edge_begin(n + 1, 0), edges;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        for (str_id_t symbol : exprs[i]->symbols)
+        {
+            auto it = node_of.find(symbol);
+            if (it != node_of.end()) edges.push_back(it->second);
+        }
+        edge_begin[i + 1] = edges.size();
+    }
+
+    vector<unsigned> index(n, none), low(n), next(n), pos(n, none), stack, call, cycle;
+    vector<bool> on_stack(n, false);
+    unsigned counter = 0;
+    bool ok = true;
+    for (unsigned root = 0; root < n; ++root)
+    {
+        if (index[root] != none) continue;
+        call.push_back(root);
+        while (!call.empty())
+        {
+            unsigned v = call.back();
+            if (index[v] == none)
+            {   // first visit
+                index[v] = low[v] = counter++;
+                next[v] = edge_begin[v];
+                stack.push_back(v);
+                on_stack[v] = true;
+            }
+            if (next[v] < edge_begin[v + 1])
+            {
+                unsigned w = edges[next[v]++];
+                if (index[w] == none) call.push_back(w);
+                else if (on_stack[w]) low[v] = std::min(low[v], index[w]);
+                continue;
+            }
+            call.pop_back();
+            if (!call.empty()) low[call.back()] = std::min(low[call.back()], low[v]);
+            if (low[v] != index[v]) continue;
+
+            // v is the root of a component, its members are on the stack above it
+            bool cyclic = stack.back() != v;
+            for (unsigned e = edge_begin[v]; e < edge_begin[v + 1]; ++e)
+                if (edges[e] == v) cyclic = true;
+            if (cyclic)
+            {   // follow edges inside the component until a symbol repeats
+                unsigned u = v;
+                while (pos[u] == none)
+                {
+                    pos[u] = cycle.size();
+                    cycle.push_back(u);
+                    for (unsigned e = edge_begin[u]; e < edge_begin[u + 1]; ++e)
+                        if (on_stack[edges[e]] && index[edges[e]] >= index[v])
+                        {
+                            u = edges[e];
+                            break;
+                        }
+                }
+                // the component is the stack from v up, name all of it (in order of first
+                // appearance) and then one cycle through it
+                size_t first = stack.size() - 1;
+                while (stack[first] != v) --first;
+                vector<str_id_t> members;
+                for (size_t i = first; i < stack.size(); ++i) members.push_back(names[stack[i]]);
+                std::sort(members.begin(), members.end());
+                errors << "ERROR: Circular definition of .equ symbols: ";
+                for (size_t i = 0; i < members.size(); ++i)
+                    errors << (i > 0 ? ", '" : "'") << strings.get(members[i]) << '\'';
+                errors << " (cycle: ";
+                for (unsigned i = pos[u]; i < cycle.size(); ++i)
+                    errors << '\'' << strings.get(names[cycle[i]]) << "' -> ";
+                errors << '\'' << strings.get(names[u]) << "')!\n";
+                for (unsigned w : cycle) pos[w] = none;
+                cycle.clear();
+                ok = false;
+            }
+            else
+            {
+                int value;
+                Equ_Expansion expansion;
+                Result res = process_expression(*exprs[v], value, true, &expansion);
+                if (res == Result::Error)
+                {
+                    errors << "ERROR: Failed to evaluate expression for .equ symbol '" << strings.get(names[v]) << "'!\n";
+                    ok = false;
+                }
+                else if (res == Result::Success)
+                {
+                    Symtab_Entry *entry = symtab.find(names[v]);
+                    entry->sym.st_shndx = SHN_ABS;
+                    entry->sym.st_value = value;
+                }
+                else if (res == Result::Reloc)
+                {
+                    symtab.find(names[v])->expansion = equ_expansions.size();
+                    equ_expansions.push_back(std::move(expansion));
+                }
+                // an unevaluated symbol stays in the map, its users are unevaluated too
+                if (res == Result::Success || res == Result::Reloc) equ_uneval_map.erase(names[v]);
+            }
+            do
+            {
+                on_stack[stack.back()] = false;
+                stack.pop_back();
+            } while (on_stack[v]);
+        }
+    }
+    equ_uneval_map.clear();
+    return ok;
 }
 
 void Assembler::print_line(Line_Info &info)
 {
-    cout << info.line_num << ":\t";
-    cout << "LC = " << setw(4) << setfill('0') << right << hex << info.loc_cnt << setw(1) << setfill(' ') << dec << "\t";
+    messages << info.line_num << ":\t";
+    messages << "LC = " << setw(4) << setfill('0') << right << hex << info.loc_cnt << setw(1) << setfill(' ') << dec << "\t";
 
-    if (!info.line.label.empty())
-        cout << info.line.label << ": ";
+    if (info.label != 0)
+        messages << strings.get(info.label) << ": ";
 
-    if (info.line.content_type == Content_Type::Directive)
+    if (info.content_type == Content_Type::Directive)
     {
-        cout << "." << parser->get_directive(info.line.getDir().code);
-        if (!info.line.getDir().p1.empty())
-            cout << " " << info.line.getDir().p1;
-        if (!info.line.getDir().p2.empty())
-            cout << ", " << info.line.getDir().p2;
-        if (!info.line.getDir().p3.empty())
-            cout << ", " << info.line.getDir().p3;
+        messages << "." << parser->get_directive(info.code);
+        if (info.dir.param[0] != 0)
+            messages << " " << strings.get(info.dir.param[0]);
+        if (info.dir.param[1] != 0)
+            messages << ", " << strings.get(info.dir.param[1]);
+        if (info.dir.param[2] != 0)
+            messages << ", " << strings.get(info.dir.param[2]);
     }
-    else if (info.line.content_type == Content_Type::Instruction)
+    else if (info.content_type == Content_Type::Instruction)
     {
-        cout << parser->get_instruction(info.line.getInstr().code);
-        if (info.line.getInstr().op_cnt > 0)
+        messages << parser->get_instruction(info.code);
+        if (info.op_cnt > 0)
         {
-            cout << (info.line.getInstr().op_size == Operand_Size::Byte ? 'b' : 'w');
-            cout << " " << info.line.getInstr().op1;
-            if (info.line.getInstr().op_cnt > 1)
-                cout << ", " << info.line.getInstr().op2;
+            messages << (info.op_size == Operand_Size::Byte ? 'b' : 'w');
+            messages << " " << strings.get(info.op[0].str);
+            if (info.op_cnt > 1)
+                messages << ", " << strings.get(info.op[1].str);
         }
     }
 
-    cout << '\n';
+    messages << '\n';
+}
+
+void Assembler::list_line(sect_handle_t sect, size_t pos)
+{
+    if (options.listing_file.empty()) return;
+    listing.push_back({ file_idx, sect, (uint32_t) pos, (uint32_t) (sections[sect].data.stored() - pos) });
+}
+
+// *** Listing file ***
+// One row per source line: line number, location counter, the first bytes the
+// line stored and the source text. Further bytes go on rows of their own.
+// Fills (.skip, .align) and .bss contents are not stored, so they show no bytes.
+
+bool Assembler::write_listing()
+{
+    Text_Writer out;
+    if (!out.open(options.listing_file, errors)) return false;
+
+    uint32_t last = line_index.size(); // Lines after .end are not listed
+    if (file_vect.size() > 1)
+    {
+        const Line_Info &info = file_vect[file_vect.size() - 2];
+        if (info.content_type == Content_Type::Directive && info.code == Directive::End) last = info.line_num;
+    }
+    auto entry = listing.begin();
+    for (uint32_t line_num = 1; line_num <= last; ++line_num)
+    {
+        const Line_Span &span = line_index[line_num - 1];
+        out.put_dec(line_num, 6);
+        out.put(' ');
+        if (entry == listing.end() || file_vect[entry->line].line_num != line_num)
+        {
+            out.pad(6 + 3 * LISTING_ROW_BYTES);
+            out.put(source.data() + span.begin, span.end - span.begin);
+            out.put('\n');
+            continue;
+        }
+        const Section_Buffer &data = sections[entry->sect].data;
+        Elf16_Addr loc_cnt = file_vect[entry->line].loc_cnt;
+        for (uint32_t done = 0; done == 0 || done < entry->count; done += LISTING_ROW_BYTES)
+        {
+            if (done != 0) out.pad(7);
+            out.put_hex((Elf16_Addr) (loc_cnt + done), 4);
+            out.put(' ');
+            uint32_t cnt = entry->count - done < LISTING_ROW_BYTES ? entry->count - done : LISTING_ROW_BYTES;
+            for (uint32_t i = 0; i < cnt; ++i)
+            {
+                out.put(' ');
+                out.put_hex(data.get(entry->pos + done + i), 2);
+            }
+            if (done == 0)
+            {
+                out.pad(3 * (LISTING_ROW_BYTES - cnt) + 1);
+                out.put(source.data() + span.begin, span.end - span.begin);
+            }
+            out.put('\n');
+        }
+        ++entry;
+    }
+    return out.close();
 }
 
-void Assembler::print_file(ostream &out)
+// *** Text object file ***
+// Counts in table titles are printed in whatever base the preceding field used,
+// as they were when this dump was written through an ostream. hex_base keeps
+// track of it so the output stays the same.
+
+void Assembler::print_file(Text_Writer &out)
 {
+    bool hex_base = false;
+    auto put_count = [&out, &hex_base](unsigned value)
+    {
+        if (hex_base) out.put_hex(value, 1);
+        else out.put_dec(value);
+    };
+
     // Output ELF Header
-    out << "ELF Header:\n";
-    out << "  Magic:   ";
+    out.put("ELF Header:\n");
+    out.put("  Magic:   ");
     for (unsigned i = 0; i < EI_NIDENT; ++i)
-        out << hex << (unsigned) elf_header.e_ident[i] << (i < EI_NIDENT - 1 ? ' ' : '\n');
-    out << "  Class:                             " << (elf_header.e_ident[EI_CLASS] == ELFCLASS16 ? "ELF16" : "unknown") << '\n';
-    out << "  Data:                              " << (elf_header.e_ident[EI_DATA] == ELFDATA2LSB ? "2's complement, little endian" : "unknown") << '\n';
-    out << "  Version:                           " << (elf_header.e_ident[EI_CLASS] == EV_CURRENT ? "1 (current)" : "unknown") << '\n';
-    out << "  Type:                              ";
+    {
+        out.put_hex(elf_header.e_ident[i], 1);
+        out.put(i < EI_NIDENT - 1 ? ' ' : '\n');
+    }
+    out.put("  Class:                             "); out.put(elf_header.e_ident[EI_CLASS] == ELFCLASS16 ? "ELF16" : "unknown"); out.put('\n');
+    out.put("  Data:                              "); out.put(elf_header.e_ident[EI_DATA] == ELFDATA2LSB ? "2's complement, little endian" : "unknown"); out.put('\n');
+    out.put("  Version:                           "); out.put(elf_header.e_ident[EI_CLASS] == EV_CURRENT ? "1 (current)" : "unknown"); out.put('\n');
+    out.put("  Type:                              ");
     switch (elf_header.e_type)
     {
-    case ET_REL: out << "REL (Relocatable file)"; break;
-    case ET_EXEC: out << "EXEC (Executable file"; break;
-    case ET_DYN: out << "DYN (Shared object file)"; break;
-    default: out << "unknown";
-    }
-    out << '\n';
-    out << "  Machine:                           " << (elf_header.e_machine == EM_VN16 ? "Von-Neumann 16-bit" : "unknown") << '\n';
-    out << "  Version:                           " << hex << (unsigned) elf_header.e_version << '\n';
-    out << "  Entry point address:               " << hex << (unsigned) elf_header.e_entry << '\n';
-    out << "  Start of program headers:          " << dec << (unsigned) elf_header.e_phoff << " (bytes into file)\n";
-    out << "  Start of section headers:          " << dec << (unsigned) elf_header.e_shoff << " (bytes into file)\n";
-    out << "  Flags:                             " << hex << (unsigned) elf_header.e_flags << '\n';
-    out << "  Size of this header:               " << dec << (unsigned) elf_header.e_ehsize << " (bytes)\n";
-    out << "  Size of program headers:           " << dec << (unsigned) elf_header.e_phentsize << " (bytes)\n";
-    out << "  Number of program headers:         " << dec << (unsigned) elf_header.e_phnum << '\n';
-    out << "  Size of section headers:           " << dec << (unsigned) elf_header.e_shentsize << " (bytes)\n";
-    out << "  Number of section headers:         " << dec << (unsigned) elf_header.e_shnum << '\n';
-    out << "  Section header string table index: " << dec << (unsigned) elf_header.e_shstrndx << '\n';
-
-    out << '\n';
-    out << "Section Headers:\n";
-    out << "  [Nr] Name                 Type                 Address   Offset\n";
-    out << "       Size      EntSize    Flags  Link   Info   Align\n";
+    case ET_REL: out.put("REL (Relocatable file)"); break;
+    case ET_EXEC: out.put("EXEC (Executable file"); break;
+    case ET_DYN: out.put("DYN (Shared object file)"); break;
+    default: out.put("unknown");
+    }
+    out.put('\n');
+    out.put("  Machine:                           "); out.put(elf_header.e_machine == EM_VN16 ? "Von-Neumann 16-bit" : "unknown"); out.put('\n');
+    out.put("  Version:                           "); out.put_hex(elf_header.e_version, 1); out.put('\n');
+    out.put("  Entry point address:               "); out.put_hex(elf_header.e_entry, 1); out.put('\n');
+    out.put("  Start of program headers:          "); out.put_dec(elf_header.e_phoff); out.put(" (bytes into file)\n");
+    out.put("  Start of section headers:          "); out.put_dec(elf_header.e_shoff); out.put(" (bytes into file)\n");
+    out.put("  Flags:                             "); out.put_hex(elf_header.e_flags, 1); out.put('\n');
+    out.put("  Size of this header:               "); out.put_dec(elf_header.e_ehsize); out.put(" (bytes)\n");
+    out.put("  Size of program headers:           "); out.put_dec(elf_header.e_phentsize); out.put(" (bytes)\n");
+    out.put("  Number of program headers:         "); out.put_dec(elf_header.e_phnum); out.put('\n');
+    out.put("  Size of section headers:           "); out.put_dec(elf_header.e_shentsize); out.put(" (bytes)\n");
+    out.put("  Number of section headers:         "); out.put_dec(elf_header.e_shnum); out.put('\n');
+    out.put("  Section header string table index: "); out.put_dec(elf_header.e_shstrndx); out.put('\n');
+
+    out.put('\n');
+    out.put("Section Headers:\n");
+    out.put("  [Nr] Name                 Type                 Address   Offset\n");
+    out.put("       Size      EntSize    Flags  Link   Info   Align\n");
 
     string flags;
     for (unsigned i = 0; i < shdrtab_vect.size(); ++i)
     {
-        out << "  [" << dec << setw(2) << setfill(' ') << right << i << "] ";
-        out << setw(20) << setfill(' ') << left << (shdrtab_vect[i]->sh_name < shstrtab_vect.size() ? shstrtab_vect[shdrtab_vect[i]->sh_name] : " ") << ' ';
-        out << setw(20) << setfill(' ') << left;
+        out.put("  ["); out.put_dec(i, 2); out.put("] ");
+        out.put_left(strings.get(sections[i].name), 20);
+        out.put(' ');
         switch (shdrtab_vect[i]->sh_type)
         {
-        case SHT_NULL: out << "NULL"; break;
-        case SHT_PROGBITS: out << "PROGBITS"; break;
-        case SHT_SYMTAB: out << "SYMTAB"; break;
-        case SHT_STRTAB: out << "STRTAB"; break;
-        case SHT_NOBITS: out << "NOBITS"; break;
-        case SHT_REL: out << "REL"; break;
-        default: out << "UNKNOWN"; break;
-        }
-        out << ' ';
-        out << setw(4) << setfill('0') << right << hex << (unsigned) shdrtab_vect[i]->sh_addr << "      ";
-        out << setw(4) << setfill('0') << right << hex << (unsigned) shdrtab_vect[i]->sh_offset << "\n       ";
-        out << setw(4) << setfill('0') << right << hex << (unsigned) shdrtab_vect[i]->sh_size << "      ";
-        out << setw(4) << setfill('0') << right << hex << (unsigned) shdrtab_vect[i]->sh_entsize << "       ";
+        case SHT_NULL: out.put_left("NULL", 20); break;
+        case SHT_PROGBITS: out.put_left("PROGBITS", 20); break;
+        case SHT_SYMTAB: out.put_left("SYMTAB", 20); break;
+        case SHT_STRTAB: out.put_left("STRTAB", 20); break;
+        case SHT_NOBITS: out.put_left("NOBITS", 20); break;
+        case SHT_REL: out.put_left("REL", 20); break;
+        default: out.put_left("UNKNOWN", 20); break;
+        }
+        out.put(' ');
+        out.put_hex(shdrtab_vect[i]->sh_addr, 4); out.put("      ");
+        out.put_hex(shdrtab_vect[i]->sh_offset, 4); out.put("\n       ");
+        out.put_hex(shdrtab_vect[i]->sh_size, 4); out.put("      ");
+        out.put_hex(shdrtab_vect[i]->sh_entsize, 4); out.put("       ");
         flags.clear();
         if (shdrtab_vect[i]->sh_flags & SHF_WRITE) flags.push_back('W');
         if (shdrtab_vect[i]->sh_flags & SHF_ALLOC) flags.push_back('A');
         if (shdrtab_vect[i]->sh_flags & SHF_EXECINSTR) flags.push_back('X');
         if (shdrtab_vect[i]->sh_flags & SHF_INFO_LINK) flags.push_back('I');
-        out << setw(7) << setfill(' ') << left << flags;
-        out << setw(7) << setfill(' ') << left << dec << (unsigned) shdrtab_vect[i]->sh_link;
-        out << setw(7) << setfill(' ') << left << dec << (unsigned) shdrtab_vect[i]->sh_info;
-        out << left << dec << (shdrtab_vect[i]->sh_addralign == 0 ? 1 : 2 << shdrtab_vect[i]->sh_addralign - 1) << '\n';
+        out.put_left(flags, 7);
+        out.put_dec_left(shdrtab_vect[i]->sh_link, 7);
+        out.put_dec_left(shdrtab_vect[i]->sh_info, 7);
+        out.put_dec(shdrtab_vect[i]->sh_addralign == 0 ? 1 : 2 << (shdrtab_vect[i]->sh_addralign - 1));
+        out.put('\n');
     }
-    out << "Key to Flags:\n  W (write), A (alloc), X (execute), I (info)\n";
+    out.put("Key to Flags:\n  W (write), A (alloc), X (execute), I (info)\n");
 
     for (auto it = shdrtab_vect.begin(); it != shdrtab_vect.end(); ++it)
     {
-        string name = shstrtab_vect[(*it)->sh_name];
+        Section &sect = sections[it - shdrtab_vect.begin()];
+        const string &name = strings.get(sect.name);
         switch ((*it)->sh_type)
         {
         case SHT_NULL: break;   // Only section header, no data
         case SHT_PROGBITS:
         {
-            vector<Elf16_Half> &data = section_map[name];
-            if (data.size() == 0) continue;
-            out << "\nContents of section '" << name << "':\n";
-            out << setw(8) << setfill(' ') << " ";
+            if (sect.data.size() == 0) continue;
+            vector<Elf16_Half> data(sect.data.size());
+            sect.data.copy_to(data.data());
+            out.put("\nContents of section '"); out.put(name); out.put("':\n");
+            out.pad(8);
             for (unsigned i = 0; i < 0x10; ++i)
-                out << hex << i << ':' << (i + 1 < 0x10 ? ' ' : '\n');
+            {
+                out.put_hex(i, 1);
+                out.put(':');
+                out.put(i + 1 < 0x10 ? ' ' : '\n');
+            }
             for (unsigned i = 0, offset = (*it)->sh_offset & ~0xf; i < data.size();)
             {
-                out << "  " << setw(4) << setfill('0') << right << hex << offset << ": ";
-                for (; offset < (*it)->sh_offset; ++offset) out << setw(1) << setfill(' ') << "   ";
-                for (unsigned j = 0; i < data.size() && j < 0x10; ++i, ++j, ++offset)
-                    out << setw(2) << setfill('0') << right << hex << (unsigned) data[i]
-                        << (j + 1 < 0x10 && i + 1 < data.size() ? ' ' : '\n');
+                out.put("  "); out.put_hex(offset, 4); out.put(": ");
+                for (; offset < (unsigned) (*it)->sh_offset; ++offset) out.put("   ");
+                unsigned cnt = data.size() - i < 0x10 ? data.size() - i : 0x10;
+                out.put_hex_bytes(&data[i], cnt);
+                out.put('\n');
+                i += cnt;
+                offset += cnt;
             }
+            hex_base = true;
         }
+        // fall through - the name check below leaves non-symtab sections
         case SHT_SYMTAB:
         {
             if (name != ".symtab") break;
-            out << "\nSymbol table '.symtab' contains " << symtab_vect.size() << " entries:\n"
-                << "  Num: Value  Size   Type       Bind       Ndx  Name\n";
+            out.put("\nSymbol table '.symtab' contains "); put_count(symtab_vect.size()); out.put(" entries:\n");
+            out.put("  Num: Value  Size   Type       Bind       Ndx  Name\n");
             for (unsigned i = 0; i < symtab_vect.size(); ++i)
             {
-                out << setw(5) << setfill(' ') << right << i << ": ";
-                out << setw(4) << setfill('0') << right << hex << (unsigned) symtab_vect[i]->st_value << "   ";
-                out << setw(7) << setfill(' ') << left << dec << (unsigned) symtab_vect[i]->st_size;
-                out << setw(11) << setfill(' ') << left;
+                out.put_dec(i, 5); out.put(": ");
+                out.put_hex(symtab_vect[i]->st_value, 4); out.put("   ");
+                out.put_dec_left(symtab_vect[i]->st_size, 7);
                 switch (ELF16_ST_TYPE(symtab_vect[i]->st_info))
                 {
-                case STT_NOTYPE: out << "NOTYPE"; break;
-                case STT_OBJECT: out << "OBJECT"; break;
-                case STT_FUNC: out << "FUNC"; break;
-                case STT_SECTION: out << "SECTION"; break;
-                case STT_FILE: out << "FILE"; break;
-                default: out << "unknown"; break;
+                case STT_NOTYPE: out.put_left("NOTYPE", 11); break;
+                case STT_OBJECT: out.put_left("OBJECT", 11); break;
+                case STT_FUNC: out.put_left("FUNC", 11); break;
+                case STT_SECTION: out.put_left("SECTION", 11); break;
+                case STT_FILE: out.put_left("FILE", 11); break;
+                default: out.put_left("unknown", 11); break;
                 }
-                out << setw(11) << setfill(' ') << left;
                 switch (ELF16_ST_BIND(symtab_vect[i]->st_info))
                 {
-                case STB_LOCAL: out << "LOCAL"; break;
-                case STB_GLOBAL: out << "GLOBAL"; break;
-                case STB_WEAK: out << "WEAK"; break;
-                default: out << "unknown"; break;
+                case STB_LOCAL: out.put_left("LOCAL", 11); break;
+                case STB_GLOBAL: out.put_left("GLOBAL", 11); break;
+                case STB_WEAK: out.put_left("WEAK", 11); break;
+                default: out.put_left("unknown", 11); break;
                 }
-                out << setw(5) << setfill(' ') << left << dec;
                 if (symtab_vect[i]->st_shndx == SHN_UNDEF)
-                    out << "UND";
+                    out.put_left("UND", 5);
                 else if (symtab_vect[i]->st_shndx == SHN_ABS)
-                    out << "ABS";
+                    out.put_left("ABS", 5);
                 else
-                    out << (unsigned) symtab_vect[i]->st_shndx;
-                out << strtab_vect[symtab_vect[i]->st_name];
-                out << '\n';
+                    out.put_dec_left(symtab_vect[i]->st_shndx, 5);
+                out.put(strtab_vect[symtab_vect[i]->st_name]);
+                out.put('\n');
+                hex_base = false;
             }
             break;
         }
@@ -411,40 +794,52 @@ void Assembler::print_file(ostream &out)
         {
             if (name == ".strtab")
             {
-                out << "\nString table '.strtab' contains " << strtab_vect.size() << " entries:\n";
+                out.put("\nString table '.strtab' contains "); put_count(strtab_vect.size()); out.put(" entries:\n");
                 for (unsigned i = 0, offset = (*it)->sh_offset; i < strtab_vect.size(); offset += (strtab_vect[i++].length() + 1))
-                    out << "  " << setw(4) << setfill('0') << right << hex << offset << ": " << strtab_vect[i] << '\n';
+                {
+                    out.put("  "); out.put_hex(offset, 4); out.put(": "); out.put(strtab_vect[i]); out.put('\n');
+                    hex_base = true;
+                }
             }
             else if (name == ".shstrtab")
             {
-                out << "\nString table '.shstrtab' contains " << shstrtab_vect.size() << " entries:\n";
-                for (unsigned i = 0, offset = (*it)->sh_offset; i < shstrtab_vect.size(); offset += (shstrtab_vect[i++].length() + 1))
-                    out << "  " << setw(4) << setfill('0') << right << hex << offset << ": " << shstrtab_vect[i] << '\n';
+                out.put("\nString table '.shstrtab' contains "); put_count(sections.size()); out.put(" entries:\n");
+                for (unsigned i = 0, offset = (*it)->sh_offset; i < sections.size(); offset += (strings.get(sections[i++].name).length() + 1))
+                {
+                    out.put("  "); out.put_hex(offset, 4); out.put(": "); out.put(strings.get(sections[i].name)); out.put('\n');
+                    hex_base = true;
+                }
             }
             break;
         }
         case SHT_NOBITS: break; // Only section header, uninitialized data
         case SHT_REL:
         {
-            out << "\nRelocation section '" << name << "' contains " << (unsigned) ((*it)->sh_size / (*it)->sh_entsize) << " entries:\n"
-                << "  Offset  Info  Type       Section              Symbol\n";
-            vector<Reltab_Entry> &reloc = reltab_map[name.substr(4)];
+            out.put("\nRelocation section '"); out.put(name); out.put("' contains ");
+            put_count((*it)->sh_size / (*it)->sh_entsize);
+            out.put(" entries:\n");
+            out.put("  Offset  Info  Type       Section              Symbol\n");
+            const vector<Reltab_Entry> &reloc = sect.relocs;
             for (unsigned i = 0; i < reloc.size(); ++i)
             {
-                out << "  " << setw(4) << setfill('0') << right << hex << reloc[i].rel.r_offset << "    ";
-                out << setw(4) << setfill('0') << right << hex << reloc[i].rel.r_info << "  ";
-                out << setw(11) << setfill(' ') << left;
+                out.put("  "); out.put_hex(reloc[i].rel.r_offset, 4); out.put("    ");
+                out.put_hex(reloc[i].rel.r_info, 4); out.put("  ");
                 switch (ELF16_R_TYPE(reloc[i].rel.r_info))
                 {
-                case R_VN_16: out << "R_VN_16"; break;
-                case R_VN_PC16: out << "R_VN_PC_16"; break;
-                default: out << "unknown"; break;
+                case R_VN_16: out.put_left("R_VN_16", 11); break;
+                case R_VN_PC16: out.put_left("R_VN_PC_16", 11); break;
+                default: out.put_left("unknown", 11); break;
                 }
                 Elf16_Sym *sym = symtab_vect[ELF16_R_SYM(reloc[i].rel.r_info)];
                 bool is_section = ELF16_ST_TYPE(sym->st_info) == STT_SECTION;
-                if (is_section) out << left << shstrtab_vect[sym->st_shndx];
-                else out << "                     " << strtab_vect[sym->st_name];
-                out << '\n';
+                if (is_section) out.put(strings.get(sections[sym->st_shndx].name));
+                else
+                {
+                    out.pad(21);
+                    out.put(strtab_vect[sym->st_name]);
+                }
+                out.put('\n');
+                hex_base = true;
             }
             break;
         }
@@ -452,43 +847,46 @@ void Assembler::print_file(ostream &out)
     }
 }
 
-void Assembler::finalize()
+bool Assembler::finalize()
 {
+    if (symtab.size() > SYMTAB_MAX)
+    {
+        errors << "ERROR: Too many symbols: " << symtab.size() << " (at most " << SYMTAB_MAX << " are allowed)!\n";
+        return false;
+    }
+
     // Add extra section headers
-    Shdrtab_Entry symtab_entry = Shdrtab_Entry(SHT_SYMTAB, 0, 0, sizeof(Elf16_Sym), sizeof(Elf16_Sym) * symtab_map.size());
-    shdrtab_map.insert(shdrtab_pair_t(".symtab", symtab_entry));
-    shstrtab_vect.push_back(".symtab");
+    sections.emplace_back(strings.intern(".symtab"), Shdrtab_Entry(sections.size(), SHT_SYMTAB, 0, 0, sizeof(Elf16_Sym), sizeof(Elf16_Sym) * symtab.size()));
+    const Shdrtab_Entry &symtab_entry = sections.back().header;
 
     unsigned size = 0;
     for (unsigned i = 0; i < strtab_vect.size(); ++i)
         size += (strtab_vect[i].length() + 1);
-    Shdrtab_Entry strtab_entry = Shdrtab_Entry(SHT_STRTAB, 0, 0, 0, size);
-    shdrtab_map.insert(shdrtab_pair_t(".strtab", strtab_entry));
-    shstrtab_vect.push_back(".strtab");
+    sections.emplace_back(strings.intern(".strtab"), Shdrtab_Entry(sections.size(), SHT_STRTAB, 0, 0, 0, size));
 
     size = 0;
-    for (auto it = shdrtab_map.begin(); it != shdrtab_map.end(); ++it)
-        size += it->first.size() + 1;
-    Shdrtab_Entry shstrtab_entry = Shdrtab_Entry(SHT_STRTAB, 0, 0, 0, size);
-    shdrtab_map.insert(shdrtab_pair_t(".shstrtab", shstrtab_entry));
-    shstrtab_vect.push_back(".shstrtab");
+    for (const Section &sect : sections)
+        size += strings.get(sect.name).size() + 1;
+    sections.emplace_back(strings.intern(".shstrtab"), Shdrtab_Entry(sections.size(), SHT_STRTAB, 0, 0, 0, size));
+    const Shdrtab_Entry &shstrtab_entry = sections.back().header;
 
     // Generate symbol header table
-    if (symtab_vect.capacity() < Symtab_Entry::symtab_index)
-        symtab_vect.resize(Symtab_Entry::symtab_index);
-    for (auto it = symtab_map.begin(); it != symtab_map.end(); ++it)
-        symtab_vect[it->second.index] = &(it->second.sym);
+    symtab_vect.resize(symtab.size());
+    for (sym_handle_t handle = 0; handle < symtab.size(); ++handle)
+        symtab_vect[handle] = &symtab.at(handle).sym;
 
     // Generate section header table
-    if (shdrtab_vect.capacity() < Shdrtab_Entry::shdrtab_index)
-        shdrtab_vect.resize(Shdrtab_Entry::shdrtab_index);
-    for (auto it = shdrtab_map.begin(); it != shdrtab_map.end(); ++it)
-        shdrtab_vect[it->second.index] = &(it->second.shdr);
+    shdrtab_vect.resize(sections.size());
+    for (sect_handle_t handle = 0; handle < sections.size(); ++handle)
+        shdrtab_vect[handle] = &sections[handle].header.shdr;
 
     // Link relocation tables to the symbol table
     for (unsigned i = 0; i < shdrtab_vect.size(); ++i)
         if (shdrtab_vect[i]->sh_type == SHT_REL)
+        {
             shdrtab_vect[i]->sh_link = symtab_entry.index;
+            shdrtab_vect[i]->sh_size = sections[i].relocs.size() * sizeof(Elf16_Rel);
+        }
 
     // ELF Header
     elf_header.e_ident[EI_MAG0]     = ELFMAG0;
@@ -510,47 +908,204 @@ void Assembler::finalize()
     elf_header.e_phentsize  = 0;
     elf_header.e_phnum      = 0;
     elf_header.e_shentsize  = sizeof(Elf16_Shdr);
-    elf_header.e_shnum      = shdrtab_map.size();
+    elf_header.e_shnum      = sections.size();
     elf_header.e_shstrndx   = shstrtab_entry.index;
+    return true;
+}
+
+bool Assembler::write_output()
+{
+    if (options.binary) return write_binary();
+    Text_Writer out;
+    if (!out.open(output_file, errors)) return false;
+    print_file(out);
+    return out.close();
 }
 
-void Assembler::write_output()
+// *** Binary object file ***
+// The layout is computed up front: ELF header, section header table, then the
+// contents of every section in section header order. Headers and symbols are
+// written from serialized copies with file offsets and string table byte
+// offsets filled in (the in-memory ones hold indices, as print_file expects),
+// everything else straight from the assembler's buffers, all with writev.
+// The ELF16 structures have no padding and are written in host byte order,
+// which must be little-endian (ELFDATA2LSB).
+
+static_assert(sizeof(Elf16_Ehdr) == 34 && sizeof(Elf16_Shdr) == 20 && sizeof(Elf16_Sym) == 10
+    && sizeof(Elf16_Rel) == 4 && sizeof(Reltab_Entry) == sizeof(Elf16_Rel), "ELF16 structures must not be padded");
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "Binary output requires a little-endian host"
+#endif
+
+bool Assembler::write_binary()
 {
-    if (output.is_open())
-        output.close();
-    if (binary)
+    vector<struct iovec> iov;
+    auto add = [&iov](const void *base, size_t len)
+    {
+        if (len == 0) return;
+        struct iovec v = { const_cast<void *>(base), len };
+        iov.push_back(v);
+    };
+
+    // String tables, names become byte offsets
+    string strtab, shstrtab;
+    vector<Elf16_Word> str_offset(strtab_vect.size());
+    for (unsigned i = 0; i < strtab_vect.size(); ++i)
     {
-        // Not implemented yet
-        // output.open(output_file, ios::out | ios::binary);
+        str_offset[i] = strtab.size();
+        strtab.append(strtab_vect[i]).push_back('\0');
     }
-    else
+    vector<Elf16_Shdr> shdrs(shdrtab_vect.size());
+    for (unsigned i = 0; i < shdrtab_vect.size(); ++i)
+    {
+        shdrs[i] = *shdrtab_vect[i];
+        shdrs[i].sh_name = shstrtab.size();
+        shstrtab.append(strings.get(sections[i].name)).push_back('\0');
+    }
+    vector<Elf16_Sym> syms(symtab_vect.size());
+    for (unsigned i = 0; i < symtab_vect.size(); ++i)
+    {
+        syms[i] = *symtab_vect[i];
+        syms[i].st_name = str_offset[syms[i].st_name];
+    }
+
+    // Layout
+    Elf16_Ehdr ehdr = elf_header;
+    ehdr.e_shoff = sizeof(Elf16_Ehdr);
+    add(&ehdr, sizeof(Elf16_Ehdr));
+    add(shdrs.data(), shdrs.size() * sizeof(Elf16_Shdr));
+    uint32_t offset = sizeof(Elf16_Ehdr) + shdrs.size() * sizeof(Elf16_Shdr);
+    std::deque<vector<Elf16_Half>> contents;
+    for (unsigned i = 0; i < shdrs.size(); ++i)
+    {
+        Elf16_Shdr &shdr = shdrs[i];
+        const Section &sect = sections[i];
+        size_t size = 0;
+        switch (shdr.sh_type)
+        {
+        case SHT_PROGBITS:
+            contents.emplace_back(sect.data.size());
+            sect.data.copy_to(contents.back().data());
+            size = contents.back().size();
+            add(contents.back().data(), size);
+            break;
+        case SHT_SYMTAB:
+            shdr.sh_link = i + 1; // .strtab follows .symtab
+            size = syms.size() * sizeof(Elf16_Sym);
+            add(syms.data(), size);
+            break;
+        case SHT_STRTAB:
+            if (i == ehdr.e_shstrndx) size = shstrtab.size(), add(shstrtab.data(), size);
+            else size = strtab.size(), add(strtab.data(), size);
+            break;
+        case SHT_REL:
+            size = sect.relocs.size() * sizeof(Elf16_Rel);
+            add(sect.relocs.data(), size);
+            break;
+        default: break; // SHT_NULL and SHT_NOBITS occupy no file space
+        }
+        shdr.sh_offset = shdr.sh_type == SHT_NULL ? 0 : offset;
+        if (shdr.sh_type != SHT_NOBITS) shdr.sh_size = size;
+        offset += size;
+    }
+    if (offset > 0xffff)
     {
-        output.open(output_file, ifstream::out);
-        print_file(output);
-        output.close();
+        errors << "ERROR: Object file size: " << offset << " exceeds the 16-bit file offset range!\n";
+        return false;
+    }
+
+    int fd = open(output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t first = 0; ok && first < iov.size();)
+    {   // normally a single call, unless there are more than IOV_MAX buffers or the write is partial
+        int cnt = std::min<size_t>(iov.size() - first, IOV_MAX);
+        ssize_t written = writev(fd, &iov[first], cnt);
+        if (written < 0)
+        {
+            ok = errno == EINTR;
+            continue;
+        }
+        for (; first < iov.size() && (size_t) written >= iov[first].iov_len; ++first)
+            written -= iov[first].iov_len;
+        if (written > 0)
+        {
+            iov[first].iov_base = (char *) iov[first].iov_base + written;
+            iov[first].iov_len -= written;
+        }
     }
+    return close(fd) == 0 && ok;
 }
 
-Result Assembler::process_line(Line_Info &info)
+// Operands are classified here too, up to the first invalid one, which is
+// classified again when its line is processed to report why in line order.
+
+void Assembler::parse_line(Parsed_Line &parsed, const Line_Span &span, ostream &errors) const
 {
-    if (info.line.label.empty() && info.line.content_type == Content_Type::None)
-        return Result::Empty; // Skip empty line
-    if (pass == Pass::First)
+    parsed.error.clear();
+    parsed.ok = parser->parse_line(Token(source.data() + span.content, source.data() + span.comment), parsed.line, parsed.error);
+    const Instruction &instr = parsed.line.instr;
+    if (!parsed.ok || parsed.line.content_type != Content_Type::Instruction) return;
+    parsed.op[0].mode = parsed.op[1].mode = Operand_Type::None;
+    for (unsigned i = 0; i < instr.op_cnt && i < 2; ++i)
+        if (!classify_operand(i == 0 ? instr.op1 : instr.op2, instr.op_size, parsed.op[i], errors)) break;
+}
+
+void Assembler::store_line(const Parsed_Line &parsed, Line_Info &info)
+{
+    const Line &line = parsed.line;
+    info.label = strings.intern(line.label);
+    info.content_type = line.content_type;
+    if (line.content_type == Content_Type::Directive)
+    {
+        info.code = line.dir.code;
+        info.dir.param[0] = strings.intern(line.dir.p1);
+        info.dir.param[1] = strings.intern(line.dir.p2);
+        info.dir.param[2] = strings.intern(line.dir.p3);
+    }
+    else if (line.content_type == Content_Type::Instruction)
     {
-        info.loc_cnt = cur_sect.loc_cnt;
-        file_vect.push_back(info);
+        info.code = line.instr.code;
+        info.op_size = line.instr.op_size;
+        info.op_cnt = line.instr.op_cnt;
+        info.op[0].str = strings.intern(line.instr.op1);
+        info.op[1].str = strings.intern(line.instr.op2);
+        for (unsigned i = 0; i < 2; ++i)
+        {
+            const Operand_Class &op = parsed.op[i];
+            info.op_mode[i] = op.mode;
+            uint8_t type = op.mode >> 4;
+            bool symbol = type == Operand_Type::ImmSym || type == Operand_Type::RegIndSym || type == Operand_Type::MemSym || type == Operand_Type::PcRelSym;
+            info.op[i].data = symbol ? strings.intern(op.symbol) : op.data;
+        }
     }
-    if (!info.line.label.empty())
+}
+
+Result Assembler::process_line(Line_Info &info)
+{
+    if (info.label != 0)
     {
-        if (pass == Pass::First && !add_symbol(info.line.label))
+        if (pass == Pass::First && !add_symbol(info.label))
             return Result::Error;   // Failed to add label symbol
-        if (info.line.content_type == Content_Type::None)
+        if (info.content_type == Content_Type::None)
             return Result::Success; // No content, processing done
     }
-    if (info.line.content_type == Content_Type::Directive)
-        return process_directive(info.line.getDir());
+    if (pass == Pass::Second && !is_sequential(info))
+    {
+        Encoder enc(*cur_sect, errors);
+        return encode_line(enc, file_idx);
+    }
+    if (info.content_type == Content_Type::Directive)
+    {
+        Directive dir;
+        dir.code = info.code;
+        dir.p1 = strings.get(info.dir.param[0]);
+        dir.p2 = strings.get(info.dir.param[1]);
+        dir.p3 = strings.get(info.dir.param[2]);
+        return process_directive(dir);
+    }
     else
-        return process_instruction(info.line.getInstr());
+        return process_instruction(info);
 }
 
 Result Assembler::process_directive(const Directive &dir)
@@ -560,30 +1115,30 @@ Result Assembler::process_directive(const Directive &dir)
     case Directive::Global:
     {
         if (pass == Pass::First) return Result::Success;
-        string symbol;
-        for (string token : lexer->split_string(dir.p1))
+        Token symbol;
+        for (Token token : lexer->split_string(dir.p1))
             if (lexer->match_symbol(token, symbol))
             {
-                if (symtab_map.count(symbol) > 0)
+                Symtab_Entry *entry = symtab.find(strings.intern(symbol));
+                if (entry != nullptr)
                 {
-                    Symtab_Entry &entry = symtab_map.at(symbol);
-                    if (entry.is_equ && entry.sym.st_shndx != SHN_ABS)
+                    if (entry->is_equ && entry->sym.st_shndx != SHN_ABS)
                     {
-                        cerr << "ERROR: Relative .equ symbol '" << symbol << "' cannot be global!\n";
+                        errors << "ERROR: Relative .equ symbol '" << symbol << "' cannot be global!\n";
                         return Result::Error;
                     }
-                    int type = ELF16_ST_TYPE(entry.sym.st_info);
-                    entry.sym.st_info = ELF16_ST_INFO(STB_GLOBAL, type);
+                    int type = ELF16_ST_TYPE(entry->sym.st_info);
+                    entry->sym.st_info = ELF16_ST_INFO(STB_GLOBAL, type);
                 }
                 else
                 {
-                    cerr << "ERROR: Global symbol '" << token << "' is undefined!\n";
+                    errors << "ERROR: Global symbol '" << token << "' is undefined!\n";
                     return Result::Error;
                 }
             }
             else
             {
-                cerr << "ERROR: Invalid symbol '" << token << "'!\n";
+                errors << "ERROR: Invalid symbol '" << token << "'!\n";
                 return Result::Error;
             }
         return Result::Success;
@@ -591,19 +1146,20 @@ Result Assembler::process_directive(const Directive &dir)
     case Directive::Extern:
     {
         if (pass == Pass::Second) return Result::Success;
-        string symbol;
-        for (string token : lexer->split_string(dir.p1))
+        Token symbol;
+        for (Token token : lexer->split_string(dir.p1))
             if (lexer->match_symbol(token, symbol))
             {
                 // If the symbol is already defined, ignore this directive
-                if (symtab_map.count(symbol) > 0) continue;
-                strtab_vect.push_back(symbol);
+                str_id_t name = strings.intern(symbol);
+                if (symtab.find(name) != nullptr) continue;
+                strtab_vect.push_back(symbol.str());
                 Symtab_Entry entry(strtab_vect.size() - 1, 0, ELF16_ST_INFO(STB_GLOBAL, STT_NOTYPE), SHN_UNDEF);
-                symtab_map.insert(symtab_pair_t(symbol, entry));
+                symtab.insert(name, entry);
             }
             else
             {
-                cerr << "ERROR: Invalid symbol '" << token << "'!\n";
+                errors << "ERROR: Invalid symbol '" << token << "'!\n";
                 return Result::Error;
             }
         return Result::Success;
@@ -612,43 +1168,41 @@ Result Assembler::process_directive(const Directive &dir)
     case Directive::Set:
     {
         if (pass == Pass::Second) return Result::Success;
-        string symbol = dir.p1;
+        str_id_t name = strings.intern(dir.p1);
+        const string &symbol = strings.get(name);
         unique_ptr<Expression> expr(new Expression());
-        if (!parser->parse_expression(dir.p2, *expr))
+        if (!parser->parse_expression(dir.p2, *expr, strings))
         {
-            cerr << "ERROR: Failed to parse expression: '" << dir.p2 << "'!\n";
+            errors << "ERROR: Failed to parse expression: '" << dir.p2 << "'!\n";
             return Result::Error;
         }
         int value;
         Result res;
-        if ((res = process_expression(*expr, value, true, symbol)) == Result::Error)
+        Equ_Expansion expansion;
+        if ((res = process_expression(*expr, value, true, &expansion)) == Result::Error)
         {
-            cerr << "ERROR: Invalid expression: '" << dir.p2 <<"'!\n";
+            errors << "ERROR: Invalid expression: '" << dir.p2 <<"'!\n";
             return Result::Error;
         }
-        if (symtab_map.count(symbol) > 0)
+        Symtab_Entry *existing = symtab.find(name);
+        if (existing != nullptr)
         {
-            Symtab_Entry &entry = symtab_map.at(symbol);
-            if (dir.code == Directive::Set || entry.sym.st_info == ELF16_ST_INFO(STB_GLOBAL, STT_NOTYPE)
-                && entry.sym.st_shndx == SHN_UNDEF && entry.sym.st_value == 0)
+            Symtab_Entry &entry = *existing;
+            if (dir.code == Directive::Set || (entry.sym.st_info == ELF16_ST_INFO(STB_GLOBAL, STT_NOTYPE)
+                && entry.sym.st_shndx == SHN_UNDEF && entry.sym.st_value == 0))
             {
-                Symtab_Entry &entry = symtab_map.at(symbol);
                 entry.sym.st_info = ELF16_ST_INFO(STB_LOCAL, STT_NOTYPE);
                 entry.sym.st_shndx = SHN_UNDEF;
                 entry.sym.st_value = value;
                 entry.is_equ = true;
-                if (res == Result::Success && entry.sym.st_shndx == SHN_UNDEF)
-                {
-                    entry.sym.st_shndx = SHN_ABS;
-                    if (equ_uneval_map.count(symbol) > 0) equ_uneval_map.erase(symbol);
-                    if (equ_reloc_map.count(symbol) > 0) equ_reloc_map.erase(symbol);
-                }
-                else if (res == Result::Uneval)
-                    equ_uneval_map.emplace(equ_uneval_pair_t(symbol, std::move(expr)));
+                entry.expansion = 0; // set below if relocatable
+                if (res == Result::Success) entry.sym.st_shndx = SHN_ABS;
+                if (res == Result::Uneval) equ_uneval_map[name] = std::move(expr);
+                else equ_uneval_map.erase(name);
             }
             else
             {
-                cerr << "ERROR: Symbol '" << symbol << "' already in use!\n";
+                errors << "ERROR: Symbol '" << symbol << "' already in use!\n";
                 return Result::Error;
             }
         }
@@ -656,8 +1210,13 @@ Result Assembler::process_directive(const Directive &dir)
         {
             strtab_vect.push_back(symbol);
             Symtab_Entry entry(strtab_vect.size() - 1, value, ELF16_ST_INFO(STB_LOCAL, STT_NOTYPE), res != Result::Success ? SHN_UNDEF : SHN_ABS, true);
-            symtab_map.insert(symtab_pair_t(symbol, entry));
-            if (res == Result::Uneval) equ_uneval_map.emplace(equ_uneval_pair_t(symbol, std::move(expr)));
+            existing = &symtab.insert(name, entry);
+            if (res == Result::Uneval) equ_uneval_map.emplace(equ_uneval_pair_t(name, std::move(expr)));
+        }
+        if (res == Result::Reloc)
+        {
+            existing->expansion = equ_expansions.size();
+            equ_expansions.push_back(std::move(expansion));
         }
         return Result::Success;
     }
@@ -666,24 +1225,19 @@ Result Assembler::process_directive(const Directive &dir)
     case Directive::Bss:
     case Directive::Section:
     {
-        if (cur_sect.name != "")
-        {
-            lc_map[cur_sect.name] = cur_sect.loc_cnt;
-            shdrtab_map.at(cur_sect.name).shdr.sh_size = cur_sect.loc_cnt;
-        }
+        if (pass == Pass::First && cur_sect != &sections[0])
+            cur_sect->header.shdr.sh_size = cur_sect->loc_cnt;
 
-        string name = dir.p1, flags = dir.p2;
+        string name = dir.p1.str(), flags = dir.p2.str();
 
         if (dir.code != Directive::Section)
             name = "." + parser->get_directive(dir.code);
 
-        cur_sect.name       = name;
-        cur_sect.loc_cnt    = lc_map[name];
-
-        if (pass == Pass::First)
-            file_vect[file_idx].loc_cnt = cur_sect.loc_cnt; // Update location counter
-
-        if (cur_sect.loc_cnt == 0 && pass == Pass::First)
+        str_id_t name_id = strings.intern(name);
+        auto it = section_ids.find(name_id);
+        if (it != section_ids.end())
+            cur_sect = &sections[it->second];
+        else
         {
             Elf16_Word sh_type = 0, sh_flags = 0;
             if (flags == "") // try to infer section type and flags from section name
@@ -694,7 +1248,7 @@ Result Assembler::process_directive(const Directive &dir)
                 else if (name == ".text") sh_flags |= SHF_EXECINSTR;
                 else if (name != ".rodata") // .rodata has only flags SHF_ALLOC which are set above
                 {
-                    cerr << "ERROR: Cannot infer section type and flags from section name: '" << name << "'\n";
+                    errors << "ERROR: Cannot infer section type and flags from section name: '" << name << "'\n";
                     return Result::Error;
                 }
                 
@@ -708,125 +1262,95 @@ Result Assembler::process_directive(const Directive &dir)
                     else if (c == 'w') sh_flags |= SHF_WRITE;
                     else if (c == 'x') sh_flags |= SHF_EXECINSTR;
             }
-            add_shdr(name, sh_type, sh_flags);
-            section_map[cur_sect.name]; // initialize an empty section vector
-        }
-        else
-        {
-            Shdrtab_Entry &entry    = shdrtab_map.at(cur_sect.name);
-            cur_sect.type           = entry.shdr.sh_type;
-            cur_sect.flags          = entry.shdr.sh_flags;
-            cur_sect.shdrtab_index  = entry.index;
+            add_shdr(name_id, sh_type, sh_flags); // becomes the current section
         }
 
+        if (pass == Pass::First)
+            file_vect[file_idx].loc_cnt = cur_sect->loc_cnt; // Update location counter
+
         return Result::Success;
     }
     case Directive::End:
     {
-        lc_map[cur_sect.name] = cur_sect.loc_cnt;
-        shdrtab_map.at(cur_sect.name).shdr.sh_size = cur_sect.loc_cnt;
+        if (pass == Pass::First) cur_sect->header.shdr.sh_size = cur_sect->loc_cnt;
         return Result::End;
     }
     case Directive::Byte:
     {
-        if (pass == Pass::First)
-            cur_sect.loc_cnt += lexer->split_string(dir.p1).size() * sizeof(Elf16_Half);
-        else
-            for (string token : lexer->split_string(dir.p1))
+        // Expressions are compiled once here and evaluated by encode_data()
+        file_vect[file_idx].dir.expr = data_exprs.size();
+        for (Token token : lexer->split_string(dir.p1))
+        {
+            data_exprs.emplace_back();
+            if (!parser->parse_expression(token, data_exprs.back(), strings))
             {
-                Expression expr;
-                if (!parser->parse_expression(token, expr))
-                {
-                    cerr << "ERROR: Failed to parse expression: '" << token << "'!\n";
-                    return Result::Error;
-                }
-                int value;
-                if (process_expression(expr, value, false) != Result::Success)
-                {
-                    cerr << "ERROR: Invalid expression: '" << token <<"'!\n";
-                    return Result::Error;
-                }
-                if (cur_sect.type == SHT_NOBITS && value != 0)
-                {
-                    cerr << "ERROR: Data cannot be initialized in .bss section!\n";
-                    return Result::Error;
-                }
-                push_byte(value);
+                errors << "ERROR: Failed to parse expression: '" << token << "'!\n";
+                return Result::Error;
             }
+            if (!advance(sizeof(Elf16_Half))) return Result::Error;
+        }
         return Result::Success;
     }
     case Directive::Word:
     {
-        if (pass == Pass::First)
-            cur_sect.loc_cnt += lexer->split_string(dir.p1).size() * sizeof(Elf16_Word);
-        else
-            for (string token : lexer->split_string(dir.p1))
+        // Expressions are compiled once here and evaluated by encode_data()
+        file_vect[file_idx].dir.expr = data_exprs.size();
+        for (Token token : lexer->split_string(dir.p1))
+        {
+            data_exprs.emplace_back();
+            if (!parser->parse_expression(token, data_exprs.back(), strings))
             {
-                Expression expr;
-                if (!parser->parse_expression(token, expr))
-                {
-                    cerr << "ERROR: Failed to parse expression: '" << token << "'!\n";
-                    return Result::Error;
-                }
-                int value;
-                if (process_expression(expr, value, false) != Result::Success)
-                {
-                    cerr << "ERROR: Invalid expression: '" << token <<"'!\n";
-                    return Result::Error;
-                }
-                if (cur_sect.type == SHT_NOBITS && value != 0)
-                {
-                    cerr << "ERROR: Data cannot be initialized in .bss section!\n";
-                    return Result::Error;
-                }
-                push_word(value);
+                errors << "ERROR: Failed to parse expression: '" << token << "'!\n";
+                return Result::Error;
             }
+            if (!advance(sizeof(Elf16_Word))) return Result::Error;
+        }
         return Result::Success;
     }
     case Directive::Align:
         {
-        if (cur_sect.name == "") return Result::Error;
+        if (cur_sect == &sections[0]) return Result::Error;
         if (dir.p1 == "")
         {
-            cerr << "ERROR: Empty alignment size parameter!\n";
+            errors << "ERROR: Empty alignment size parameter!\n";
             return Result::Error;
         }
         Elf16_Half alignment;
         if (!parser->decode_byte(dir.p1, alignment))
         {
-            cerr << "ERROR: Failed to decode: '" << dir.p1 << "' as a byte value!\n";
+            errors << "ERROR: Failed to decode: '" << dir.p1 << "' as a byte value!\n";
             return Result::Error;
         }
         Elf16_Half fill;
         if (dir.p2 == "") fill = 0x00;
         else if (!parser->decode_byte(dir.p2, fill))
         {
-            cerr << "ERROR: Failed to decode: '" << dir.p2 << "' as a byte value!\n";
+            errors << "ERROR: Failed to decode: '" << dir.p2 << "' as a byte value!\n";
             return Result::Error;
         }
         Elf16_Half max;
         if (dir.p3 == "") max = alignment;
         else if (!parser->decode_byte(dir.p3, max))
         {
-            cerr << "ERROR: Failed to decode: '" << dir.p3 << "' as a byte value!\n";
+            errors << "ERROR: Failed to decode: '" << dir.p3 << "' as a byte value!\n";
             return Result::Error;
         }
         if (!alignment || alignment & (alignment - 1))
         {
-            cerr << "ERROR: Value: " << alignment << " is not a power of two! Cannot apply alignment!\n";
+            errors << "ERROR: Value: " << alignment << " is not a power of two! Cannot apply alignment!\n";
             return Result::Error;
         }
-        Elf16_Word remainder = cur_sect.loc_cnt & (alignment - 1);
+        Elf16_Word remainder = cur_sect->loc_cnt & (alignment - 1);
         if (remainder)
         {
             unsigned size = alignment - remainder;
             if (size > max)
             {
-                cerr << "ERROR: Required fill: " << size << " is larger than max allowed: " << (unsigned) max << "! Cannot apply alignment!\n";
+                errors << "ERROR: Required fill: " << size << " is larger than max allowed: " << (unsigned) max << "! Cannot apply alignment!\n";
                 return Result::Error;
             }
-            if (pass == Pass::First) cur_sect.loc_cnt += size * sizeof(Elf16_Half);
-            else for (unsigned i = 0; i < size; ++i) push_byte(fill);
+            if (!advance(size * sizeof(Elf16_Half))) return Result::Error;
+            file_vect[file_idx].dir.expr = size << 8 | fill; // Filled by encode_line()
         }
         return Result::Success;
     }
@@ -834,237 +1358,252 @@ Result Assembler::process_directive(const Directive &dir)
     {
         if (dir.p1 == "")
         {
-            cerr << "ERROR: Empty skip size parameter!\n";
+            errors << "ERROR: Empty skip size parameter!\n";
             return Result::Error;
         }
-        Elf16_Half size;
-        if (!parser->decode_byte(dir.p1, size))
+        Elf16_Word size;
+        if (!parser->decode_word(dir.p1, size))
         {
-            cerr << "ERROR: Failed to decode: '" << dir.p1 << "' as a byte value!\n";
+            errors << "ERROR: Failed to decode: '" << dir.p1 << "' as a word value!\n";
             return Result::Error;
         }
         Elf16_Half fill;
         if (dir.p2 == "") fill = 0x00;
         else if (!parser->decode_byte(dir.p2, fill))
         {
-            cerr << "ERROR: Failed to decode: '" << dir.p2 << "' as a byte value!\n";
+            errors << "ERROR: Failed to decode: '" << dir.p2 << "' as a byte value!\n";
             return Result::Error;
         }
-        if (pass == Pass::First) cur_sect.loc_cnt += size * sizeof(Elf16_Half);
-        else for (unsigned i = 0; i < size; ++i) push_byte(fill);
+        if (!advance(size * sizeof(Elf16_Half))) return Result::Error;
+        file_vect[file_idx].dir.expr = size << 8 | fill; // Filled by encode_line()
         return Result::Success;
     }
     default: return Result::Error;
     }
 }
 
-Result Assembler::process_instruction(const Instruction &instr)
+// Moves the location counter of the current section size bytes ahead, unless
+// the section would grow past LOC_CNT_MAX
+
+bool Assembler::advance(unsigned size)
 {
-    if (!(cur_sect.flags & SHF_EXECINSTR))
+    if (cur_sect->loc_cnt + size > LOC_CNT_MAX)
     {
-        cerr << "ERROR: Code in unexecutable section: '" << cur_sect.name << "'!\n";
-        return Result::Error;
+        errors << "ERROR: Section: '" << strings.get(cur_sect->name) << "' would be larger than "
+               << LOC_CNT_MAX << " bytes!\n";
+        return false;
     }
-    if (instr.op_cnt == 0)
-    {   // zero-address instructions
-        if (pass == Pass::First) cur_sect.loc_cnt += sizeof(Elf16_Half);
-        else push_byte(instr.code << 3);
-        return Result::Success;
+    cur_sect->loc_cnt += size;
+    return true;
+}
+
+// Encoded size of a classified operand: its descriptor and what follows it
+
+static uint8_t operand_size(const Line_Info &info, unsigned i)
+{
+    switch (info.op_type(i))
+    {
+    case Operand_Type::Imm:
+    case Operand_Type::ImmSym:
+        return sizeof(Elf16_Half) + info.op_size;
+    case Operand_Type::RegIndOff8:
+        return sizeof(Elf16_Half) + sizeof(Elf16_Half);
+    case Operand_Type::RegIndOff16:
+    case Operand_Type::RegIndSym:
+    case Operand_Type::MemSym:
+    case Operand_Type::PcRelSym:
+    case Operand_Type::MemAbs:
+        return sizeof(Elf16_Half) + sizeof(Elf16_Word);
+    default: return sizeof(Elf16_Half); // RegDir, RegInd
     }
-    else if (instr.op_cnt == 1)
-    {   // one-address instructions
-        if (pass == Pass::First)
-        {
-            int op_size = get_operand_code_size(instr.op1, instr.op_size);
-            if (op_size < 1) return Result::Error;
-            cur_sect.loc_cnt += sizeof(Elf16_Half) + op_size;
-        }
-        else
-        {
-            Elf16_Half opcode = instr.code << 3;
-            if (instr.op_size == Operand_Size::Word) opcode |= 0x4; // S bit = 0 for byte sized operands, = 1 for word sized operands
-            push_byte(opcode);
-            if (!insert_operand(instr.op1, instr.op_size, file_vect[file_idx + 1].loc_cnt)) return Result::Error;
+}
+
+Result Assembler::process_instruction(Line_Info &info)
+{
+    if (!(cur_sect->header.shdr.sh_flags & SHF_EXECINSTR))
+    {
+        errors << "ERROR: Code in unexecutable section: '" << strings.get(cur_sect->name) << "'!\n";
+        return Result::Error;
+    }
+    if (info.op_cnt > 2) return Result::Error;
+    unsigned size = sizeof(Elf16_Half);
+    for (unsigned i = 0; i < info.op_cnt; ++i)
+    {
+        if (info.op_type(i) == Operand_Type::None)
+        {   // Invalid, classify it again to report the error
+            Operand_Class op;
+            classify_operand(strings.get(info.op[i].str), info.op_size, op, errors);
+            return Result::Error;
         }
+        size += operand_size(info, i);
+    }
+    return advance(size) ? Result::Success : Result::Error;
+}
+
+// *** Encoding ***
+// The second pass encodes a line from its record alone, the first pass has
+// already sized it and stored everything it needs. Errors go to the encoder.
+
+Result Assembler::encode_line(Encoder &enc, uint32_t line)
+{
+    const Line_Info &info = file_vect[line];
+    enc.line = line;
+    enc.loc_cnt = info.loc_cnt;
+    if (info.content_type == Content_Type::Instruction) return encode_instruction(enc, info);
+    if (info.content_type != Content_Type::Directive) return Result::Success;
+    switch (info.code)
+    {
+    case Directive::Byte:
+    case Directive::Word:
+        return encode_data(enc, info);
+    case Directive::Align:
+    case Directive::Skip:
+        push_fill(enc, info.dir.expr & 0xff, info.dir.expr >> 8);
         return Result::Success;
+    default: return Result::Success; // Nothing to encode
     }
-    else if (instr.op_cnt == 2)
-    {   // two-address instructions
-        if (pass == Pass::First)
+}
+
+Result Assembler::encode_instruction(Encoder &enc, const Line_Info &info)
+{
+    Elf16_Half opcode = info.code << 3;
+    if (info.op_cnt > 0 && info.op_size == Operand_Size::Word) opcode |= 0x4; // S bit = 0 for byte sized operands, = 1 for word sized operands
+    // The next line is not stored yet when a single-pass line is encoded right away, it has no symbol operands then
+    Elf16_Addr next_instr = enc.line + 1 < file_vect.size() ? file_vect[enc.line + 1].loc_cnt : 0;
+    push_byte(enc, opcode);
+    for (unsigned i = 0; i < info.op_cnt; ++i)
+        if (!insert_operand(enc, info, i, next_instr)) return Result::Error;
+    return Result::Success;
+}
+
+Result Assembler::encode_data(Encoder &enc, const Line_Info &info)
+{
+    const Expression *expr = &data_exprs[info.dir.expr];
+    for (Token token : lexer->split_string(strings.get(info.dir.param[0])))
+    {
+        int value;
+        if (process_expression(*expr++, value, false, nullptr, &enc) != Result::Success)
         {
-            int op1_size = get_operand_code_size(instr.op1, instr.op_size);
-            if (op1_size < 1) return Result::Error;
-            int op2_size = get_operand_code_size(instr.op2, instr.op_size);
-            if (op2_size < 1) return Result::Error;
-            cur_sect.loc_cnt += sizeof(Elf16_Half) + op1_size + op2_size;
+            *enc.errors << "ERROR: Invalid expression: '" << token <<"'!\n";
+            return Result::Error;
         }
-        else
+        if (enc.sect->header.shdr.sh_type == SHT_NOBITS && value != 0)
         {
-            Elf16_Half opcode = instr.code << 3;
-            if (instr.op_size == Operand_Size::Word) opcode |= 0x4; // S bit = 0 for byte sized operands, = 1 for word sized operands
-            push_byte(opcode);
-            if (!insert_operand(instr.op1, instr.op_size, file_vect[file_idx + 1].loc_cnt)) return Result::Error;
-            if (!insert_operand(instr.op2, instr.op_size, file_vect[file_idx + 1].loc_cnt)) return Result::Error;
+            *enc.errors << "ERROR: Data cannot be initialized in .bss section!\n";
+            return Result::Error;
         }
-        return Result::Success;
+        if (info.code == Directive::Byte) push_byte(enc, value);
+        else push_word(enc, value);
     }
-    return Result::Error;
+    return Result::Success;
 }
 
-Result Assembler::process_expression(const Expression &expr, int &value, bool allow_undef, const string &equ_name)
+Result Assembler::process_expression(const Expression &expr, int &value, bool allow_undef, Equ_Expansion *expansion, Encoder *enc)
 {
+    ostream &errors = enc != nullptr ? *enc->errors : this->errors;
     typedef struct { int value, clidx, shndx; } operand_t; // clidx: 0 = ABS, 1 = REL, other = INVALID
-    typedef Operator_Token operator_t;
-    stack<operand_t> values;
-    stack<operator_t> ops;
-    int rank = 0;
+    operand_t values[EXPR_STACK_MAX];
+    unsigned cnt = 0;
     value = 0;
-    for (auto &token : expr)
+    for (const Expression_Op &instr : expr.code)
     {
-        if (token->type == Expression_Token::Operator)
+        if (instr.code == Expression_Op::Number)
         {
-            auto &op = static_cast<Operator_Token&>(*token);
-            if (op.op_type == Operator_Token::Open)
-                ops.push(op);
-            else
-            {
-                while (!ops.empty() && (
-                    op.op_type == Operator_Token::Close && ops.top().op_type != Operator_Token::Open || 
-                    op.op_type != Operator_Token::Close && ops.top().priority() >= op.priority()))
-                {
-                    operand_t val2 = values.top();
-                    values.pop();
-                    operand_t val1 = values.top();
-                    values.pop();
-                    Operator_Token oper = ops.top();
-                    ops.pop();
-                    operand_t result;
-                    result.shndx = oper.get_st_shndx(val1.shndx, val2.shndx);
-                    // Any bad combination of operator, val1 section id, val2 section id
-                    // returns -1 which means its incompatible!
-                    if (result.shndx == -1)
-                    {
-                        cerr << "ERROR: Invalid operands (*" << get_section_name(val1.shndx) << "* and *"
-                                << get_section_name(val2.shndx) << "* sections) for operator '" << oper.get_symbol() << "'!\n";
-                        return Result::Error;
-                    }
-                    result.clidx = oper.get_clidx(val1.clidx, val2.clidx);
-                    result.value = oper.calculate(val1.value, val2.value);
-                    values.push(result);
-                    rank--;
-                    if (rank < 1) return Result::Error;
-                }
-                if (op.op_type == Operator_Token::Close)
-                    ops.pop(); // Pop opening brace
-                else
-                    ops.push(op); // Push current operator
-            }
-        }
-        else if (token->type == Expression_Token::Number)
-        {
-            auto &num = static_cast<Number_Token&>(*token);
-            operand_t op;
-            op.value = num.value;
+            operand_t &op = values[cnt++];
+            op.value = instr.value;
             op.clidx = 0; // absolute value
             op.shndx = SHN_ABS; // absolute value
-            values.push(op);
-            rank++;
         }
-        else
+        else if (instr.code == Expression_Op::Symbol)
         {
-            auto &sym = static_cast<Symbol_Token&>(*token);
-            Symtab_Entry entry;
-            if (!get_symtab_entry(sym.name, entry, allow_undef))
+            Symtab_Entry *entry = get_symtab_entry(expr.symbols[instr.value], errors, allow_undef);
+            if (allow_undef && entry != nullptr && entry->is_equ && entry->sym.st_shndx == SHN_UNDEF
+                && equ_uneval_map.count(expr.symbols[instr.value]) > 0)
+                entry = nullptr; // .equ symbol that is not evaluated yet
+            if (entry == nullptr)
             {
                 if (allow_undef) return Result::Uneval;
                 return Result::Error;
             }
-            operand_t op;
-            op.value = ELF16_ST_BIND(entry.sym.st_info) == STB_LOCAL ? entry.sym.st_value : 0;
-            op.clidx = (entry.sym.st_shndx == SHN_ABS ? 0 : 1);
-            op.shndx = entry.sym.st_shndx;
-            values.push(op);
-            rank++;
-        }
-    }
-    while (!ops.empty())
-    {
-        operand_t val2 = values.top();
-        values.pop();
-        operand_t val1 = values.top();
-        values.pop();
-        Operator_Token oper = ops.top();
-        ops.pop();
-        operand_t result;
-        result.shndx = oper.get_st_shndx(val1.shndx, val2.shndx);
-        // Any bad combination of operator, val1 section id, val2 section id
-        // returns -1 which means its incompatible!
-        if (result.shndx == -1)
-        {
-            cerr << "ERROR: Invalid operands (*" << get_section_name(val1.shndx) << "* and *"
-                    << get_section_name(val2.shndx) << "* sections) for operator '" << oper.get_symbol() << "'!\n";
-            return Result::Error;
+            operand_t &op = values[cnt++];
+            op.value = ELF16_ST_BIND(entry->sym.st_info) == STB_LOCAL ? entry->sym.st_value : 0;
+            if (entry->expansion != 0) op.value = equ_expansions[entry->expansion].addend;
+            op.clidx = (entry->sym.st_shndx == SHN_ABS ? 0 : 1);
+            op.shndx = entry->sym.st_shndx;
+        }
+        else
+        {   // Operands are guaranteed by parse_expression
+            Operator_Token oper((Operator_Token::Operator_Type) instr.code);
+            operand_t &val1 = values[cnt - 2], &val2 = values[cnt - 1];
+            int shndx = oper.get_st_shndx(val1.shndx, val2.shndx);
+            // Any bad combination of operator, val1 section id, val2 section id
+            // returns -1 which means its incompatible!
+            if (shndx == -1)
+            {
+                errors << "ERROR: Invalid operands (*" << get_section_name(val1.shndx) << "* and *"
+                        << get_section_name(val2.shndx) << "* sections) for operator '" << oper.get_symbol() << "'!\n";
+                return Result::Error;
+            }
+            if (oper.divides() && val2.value == 0)
+            {
+                errors << "ERROR: Division by zero with operator '" << oper.get_symbol() << "'!\n";
+                return Result::Error;
+            }
+            val1.shndx = shndx;
+            val1.clidx = oper.get_clidx(val1.clidx, val2.clidx);
+            val1.value = oper.calculate(val1.value, val2.value);
+            cnt--;
         }
-        result.clidx = oper.get_clidx(val1.clidx, val2.clidx);
-        result.value = oper.calculate(val1.value, val2.value);
-        values.push(result);
-        rank--;
     }
-    if (rank != 1) return Result::Error;
-    operand_t result = values.top();
-    values.pop();
+    if (cnt != 1) return Result::Error;
+    const operand_t &result = values[0];
     if (result.clidx == 0) value = result.value;
     else if (result.clidx == 1)
     {
-        if (!equ_name.empty())
+        if (expansion != nullptr)
         {
             vector<Reltab_Entry> reloc_vect;
-            for (auto &token : expr)
-                if (token->type == Expression_Token::Symbol)
+            for (str_id_t symbol : expr.symbols)
+                if (!insert_reloc(nullptr, symbol, R_VN_16, 0, false, &reloc_vect))
                 {
-                    auto &sym = static_cast<Symbol_Token&>(*token);
-                    if (!insert_reloc(sym.name, R_VN_16, 0, false, &reloc_vect))
-                    {
-                        cerr << "ERROR: Failed to insert .equ reloc for: '" << sym.name << "'!\n";
-                        return Result::Error;
-                    }
+                    errors << "ERROR: Failed to insert .equ reloc for: '" << strings.get(symbol) << "'!\n";
+                    return Result::Error;
                 }
-            equ_reloc_map.insert(equ_relocs_pair_t(equ_name, reloc_pair_t(result.value, reloc_vect)));
+            expansion->addend = result.value;
+            for (const Reltab_Entry &reloc : reloc_vect)
+                expansion->symbols.push_back(ELF16_R_SYM(reloc.rel.r_info));
+            if (expansion->symbols.size() == 1)
+            {
+                const Elf16_Sym &sym = symtab.at(expansion->symbols[0]).sym;
+                if (ELF16_ST_BIND(sym.st_info) != STB_GLOBAL) expansion->local_shndx = sym.st_shndx;
+            }
             return Result::Reloc;
         }
         else
         {
-            for (auto &token : expr)
-                if (token->type == Expression_Token::Symbol)
+            for (str_id_t symbol : expr.symbols)
+                if (!insert_reloc(enc, symbol, R_VN_16, 0, false))
                 {
-                    auto &sym = static_cast<Symbol_Token&>(*token);
-                    if (!insert_reloc(sym.name, R_VN_16, 0, false))
-                    {
-                        cerr << "ERROR: Failed to insert reloc for: '" << sym.name << "'!\n";
-                        return Result::Error;
-                    }
+                    errors << "ERROR: Failed to insert reloc for: '" << strings.get(symbol) << "'!\n";
+                    return Result::Error;
                 }
             value = result.value;
         }
     }
     else
     {
-        cerr << "ERROR: Invalid class index: " << result.clidx << "!\n";
+        errors << "ERROR: Invalid class index: " << result.clidx << "!\n";
         return Result::Error;
     }
     return Result::Success;
 }
 
-bool Assembler::get_symtab_entry(const string &str, Symtab_Entry &entry, bool silent)
+Symtab_Entry *Assembler::get_symtab_entry(str_id_t symbol, ostream &errors, bool silent)
 {
-    if (symtab_map.count(str) == 0)
-    {
-        if (!silent)
-            cerr << "ERROR: Undefined reference to: '" << str << "'!\n";
-        return false;
-    }
-    entry = symtab_map.at(str);
-    return true;
+    Symtab_Entry *entry = symtab.find(symbol);
+    if (entry == nullptr && !silent)
+        errors << "ERROR: Undefined reference to: '" << strings.get(symbol) << "'!\n";
+    return entry;
 }
 
 string Assembler::get_section_name(unsigned shndx)
@@ -1074,382 +1613,379 @@ string Assembler::get_section_name(unsigned shndx)
     else if (shndx == SHN_ABS)
         return "ABS";
     else
-        return shstrtab_vect[shndx];
+        return strings.get(sections[shndx].name);
 }
 
-int Assembler::get_operand_code_size(const string &str, uint8_t expected_size)
+bool Assembler::classify_operand(const Token &str, uint8_t op_size, Operand_Class &result, ostream &errors) const
 {
-    if (expected_size == Operand_Size::None) return 0;  // Invalid parameter
-    string token1, token2;
+    result.mode = Operand_Type::None;
+    result.data = 0;
+    result.symbol = Token();
+    if (op_size == Operand_Size::None) return false;   // Invalid parameter
+    uint8_t type, reg = 0;
+    Token token1, token2;
     if (lexer->match_imm_w(str, token1))
     {
-        if (token1[0] != '&')
-        {   // token1 is a number, not a symbol
-            if (expected_size == Operand_Size::Byte)
+        if (token1[0] == '&')
+        {   // Symbol value is not known yet, it is resolved in the second pass
+            type = Operand_Type::ImmSym;
+            result.symbol = token1.substr(1);
+        }
+        else if (op_size == Operand_Size::Byte)
+        {
+            Elf16_Half byte;
+            if (!parser->decode_byte(token1, byte))
             {
-                Elf16_Half byte;
-                if (!parser->decode_byte(token1, byte))
-                {
-                    cerr << "ERROR: Invalid byte operand: '" << token1 << "'!\n";
-                    return 0;
-                }
+                errors << "ERROR: Invalid byte operand: '" << token1 << "'!\n";
+                return false;
             }
-            else
+            type = Operand_Type::Imm;
+            result.data = byte;
+        }
+        else
+        {
+            Elf16_Word word;
+            if (!parser->decode_word(token1, word))
             {
-                Elf16_Word word;
-                if (!parser->decode_word(token1, word))
-                {
-                    cerr << "ERROR: Invalid word operand: '" << token1 << "'!\n";
-                    return 0;
-                }
+                errors << "ERROR: Invalid word operand: '" << token1 << "'!\n";
+                return false;
             }
+            type = Operand_Type::Imm;
+            result.data = word;
         }
-        // If token1 is a symbol, we cannot verify it now, just return expected size
-        return sizeof(Elf16_Half) + expected_size;
     }
-    else if (expected_size == Operand_Size::Byte && lexer->match_regdir_b(str, token1)
-          || expected_size == Operand_Size::Word && lexer->match_regdir_w(str, token1)
-          || lexer->match_regind(str, token1))
-        return sizeof(Elf16_Half); // Regdir/Regind only needs opdesc so 1B
+    else if (op_size == Operand_Size::Byte && lexer->match_regdir_b(str, token1))
+    {
+        type = Operand_Type::RegDir;
+        reg = (token1[1] - '0') << 1;
+        if (token1[2] == 'h') reg |= 0x1;
+    }
+    else if (op_size == Operand_Size::Word && lexer->match_regdir_w(str, token1))
+    {
+        if (!parser->decode_register(token1, reg))
+        {
+            errors << "ERROR: Invalid register: '" << token1 << "'!\n";
+            return false;
+        }
+        type = Operand_Type::RegDir;
+    }
+    else if (lexer->match_regind(str, token1))
+    {
+        if (!parser->decode_register(token1, reg))
+        {
+            errors << "ERROR: Invalid register: '" << token1 << "'!\n";
+            return false;
+        }
+        type = Operand_Type::RegInd;
+    }
     else if (lexer->match_regindoff(str, token1, token2))
     {
+        if (!parser->decode_register(token1, reg))
+        {
+            errors << "ERROR: Invalid register: '" << token1 << "'!\n";
+            return false;
+        }
         Elf16_Half byteoff;
         Elf16_Word wordoff;
-        if (parser->decode_byte(token2, byteoff)) return sizeof(Elf16_Half) + (byteoff == 0 ? 0 : sizeof(Elf16_Half));
-        else if (parser->decode_word(token2, wordoff)) return sizeof(Elf16_Half) + (wordoff == 0 ? 0 : sizeof(Elf16_Word));
+        if (parser->decode_byte(token2, byteoff))
+        {
+            type = byteoff == 0 ? Operand_Type::RegInd : Operand_Type::RegIndOff8; // zero-offset = regind without offset
+            result.data = byteoff;
+        }
+        else if (parser->decode_word(token2, wordoff))
+        {
+            type = wordoff == 0 ? Operand_Type::RegInd : Operand_Type::RegIndOff16;
+            result.data = wordoff;
+        }
         else
         {
-            cerr << "ERROR: Invalid offset: '" << token2 << "'!\n";
+            errors << "ERROR: Invalid offset: '" << token2 << "'!\n";
             return false;
         }
-        return true;
     }
-    else if (lexer->match_regindsym(str, token1, token2) || lexer->match_memsym(str, token1))
-        return sizeof(Elf16_Half) + sizeof(Elf16_Addr);
+    else if (lexer->match_regindsym(str, token1, token2))
+    {
+        if (!parser->decode_register(token1, reg))
+        {
+            errors << "ERROR: Invalid register: '" << token1 << "'!\n";
+            return false;
+        }
+        type = Operand_Type::RegIndSym;
+        result.symbol = token2;
+    }
+    else if (lexer->match_memsym(str, token1))
+    {
+        bool pcrel = token1[0] == '$';
+        type = pcrel ? Operand_Type::PcRelSym : Operand_Type::MemSym;
+        result.symbol = pcrel ? token1.substr(1) : token1;
+    }
     else if (lexer->match_memabs(str, token1))
     {
         Elf16_Word address;
         if (!parser->decode_word(token1, address))
         {
-            cerr << "ERROR: Invalid address: '" << token1 << "'!\n";
+            errors << "ERROR: Invalid address: '" << token1 << "'!\n";
             return false;
         }
-        return sizeof(Elf16_Half) + sizeof(Elf16_Addr);
+        type = Operand_Type::MemAbs;
+        result.data = address;
     }
-    cerr << "ERROR: Invalid operand: '" << str << "'!\n";
-    return 0;
+    else
+    {
+        errors << "ERROR: Invalid operand: '" << str << "'!\n";
+        return false;
+    }
+    result.mode = type << 4 | reg;
+    return true;
 }
 
-bool Assembler::add_symbol(const string &symbol)
+bool Assembler::add_symbol(str_id_t symbol)
 {
-    bool exists = symtab_map.count(symbol) > 0;
+    Symtab_Entry *existing = symtab.find(symbol);
+    bool exists = existing != nullptr;
 
     Elf16_Word name = 0;
     Elf16_Half type = STT_NOTYPE;
 
-    if (symbol == cur_sect.name) type = STT_SECTION;
+    if (symbol == cur_sect->name) type = STT_SECTION;
     else
     {
-        if (exists) name = symtab_map.at(symbol).sym.st_name;
+        if (exists) name = existing->sym.st_name;
         else
         {
-            strtab_vect.push_back(symbol);
+            strtab_vect.push_back(strings.get(symbol));
             name = strtab_vect.size() - 1;
         }
-        if (cur_sect.flags & SHF_EXECINSTR) type = STT_FUNC;
-        else if (cur_sect.flags & SHF_ALLOC) type = STT_OBJECT;
+        if (cur_sect->header.shdr.sh_flags & SHF_EXECINSTR) type = STT_FUNC;
+        else if (cur_sect->header.shdr.sh_flags & SHF_ALLOC) type = STT_OBJECT;
     }
 
     if (exists)
     {
-        Symtab_Entry &entry = symtab_map.at(symbol);
+        Symtab_Entry &entry = *existing;
         if (entry.sym.st_value == 0 && entry.sym.st_shndx == SHN_UNDEF
             && entry.sym.st_info == ELF16_ST_INFO(STB_GLOBAL, STT_NOTYPE))
         {   // extern global symbol
             entry.is_equ = false;
             entry.sym.st_info = ELF16_ST_INFO(STB_LOCAL, type);
-            entry.sym.st_shndx = cur_sect.shdrtab_index;
-            entry.sym.st_value = cur_sect.loc_cnt;
+            entry.sym.st_shndx = cur_sect->header.index;
+            entry.sym.st_value = cur_sect->loc_cnt;
             return true;
         }
         else
         {
-            cerr << "ERROR: Symbol '" << symbol << "' already in use!\n";
+            errors << "ERROR: Symbol '" << strings.get(symbol) << "' already in use!\n";
             return false;
         }
     }
 
-    Symtab_Entry entry(name, cur_sect.loc_cnt, ELF16_ST_INFO(STB_LOCAL, type), cur_sect.shdrtab_index);
-    symtab_map.insert(symtab_pair_t(symbol, entry));
+    Symtab_Entry entry(name, cur_sect->loc_cnt, ELF16_ST_INFO(STB_LOCAL, type), cur_sect->header.index);
+    symtab.insert(symbol, entry);
 
     return true;
 }
 
-bool Assembler::add_shdr(const string &name, Elf16_Word type, Elf16_Word flags, bool reloc, Elf16_Word info, Elf16_Word entsize)
+sect_handle_t Assembler::add_shdr(str_id_t name, Elf16_Word type, Elf16_Word flags, bool reloc, Elf16_Word info, Elf16_Word entsize)
 {
-    if (shdrtab_map.count(name) > 0)
-        return true;
-
-    Shdrtab_Entry entry(type, flags, info, entsize);
-    shdrtab_map.insert(shdrtab_pair_t(name, entry));
-    shstrtab_vect.push_back(name);
+    sections.emplace_back(name, Shdrtab_Entry(sections.size(), type, flags, info, entsize));
+    Section &sect = sections.back();
+    section_ids.emplace(name, sect.header.index);
 
     if (!reloc)
     {
-        cur_sect.type           = entry.shdr.sh_type;
-        cur_sect.flags          = entry.shdr.sh_flags;
-        cur_sect.shdrtab_index  = entry.index;
-        if (!add_symbol(cur_sect.name)) return false;
+        cur_sect = &sect;
+        add_symbol(name); // a clash with an existing symbol is reported but not fatal
+        sect.symbol = symtab.find(name)->index;
     }
 
-    return true;
+    return sect.header.index;
 }
 
-void Assembler::push_byte(Elf16_Half byte)
+// Only SHT_PROGBITS sections store their contents, the others just count them
+
+void Assembler::store_byte(Encoder &enc, Elf16_Half byte)
 {
-    section_map.at(cur_sect.name).push_back(byte);
-    cur_sect.loc_cnt += sizeof(Elf16_Half);
+    if (enc.patch_pos == NO_PATCH) enc.data->push(byte);
+    else enc.data->patch(enc.patch_pos++, byte);
 }
 
-void Assembler::push_word(Elf16_Word word)
+void Assembler::push_byte(Encoder &enc, Elf16_Half byte)
 {
-    section_map.at(cur_sect.name).push_back(word & 0xff); // little-endian
-    section_map.at(cur_sect.name).push_back(word >> 8);
-    cur_sect.loc_cnt += sizeof(Elf16_Word);
+    if (enc.sect->header.shdr.sh_type == SHT_PROGBITS) store_byte(enc, byte);
+    enc.loc_cnt += sizeof(Elf16_Half);
 }
 
-bool Assembler::insert_operand(const string &str, uint8_t size, Elf16_Addr next_instr)
+void Assembler::push_word(Encoder &enc, Elf16_Word word)
 {
-    if (size == Operand_Size::None) return false;
-    string token1, token2;
-    if (size == Operand_Size::Byte)
+    if (enc.sect->header.shdr.sh_type == SHT_PROGBITS)
     {
-        if (lexer->match_imm_b(str, token1))
-        {
-            push_byte(Addressing_Mode::Imm);
-            if (token1[0] == '&')
-            {
-                Symtab_Entry entry;
-                if (!get_symtab_entry(token1, entry)) return false;
-                if (entry.sym.st_shndx != SHN_ABS)
-                {
-                    cerr << "ERROR: Symbol: '" << token1 << "' is not an absolute symbol and cannot be used for byte-immediate addressing!\n";
-                    return false;
-                }
-                int16_t value = entry.sym.st_value;
-                push_byte(value & 0xff);
-                if (value >= -128 && value <= 127) return true;
-                cerr << "ERROR: Value of absolute symbol: '" << token1 << "' is greater than a byte value and cannot be used for byte-immediate addressing!\n";
-                return false;
-            }
-            else
-            {
-                Elf16_Half byte;
-                if (!parser->decode_byte(token1, byte))
-                {
-                    cerr << "ERROR: Failed to decode: '" << token1 << "' as a byte value!\n";
-                    return false;
-                }
-                push_byte(byte);
-                return true;
-            }
-        }
-        else if (lexer->match_regdir_b(str, token1))
-        {
-            Elf16_Half opdesc = Addressing_Mode::RegDir;
-            opdesc |= (token1[1] - '0') << 1;
-            if (token1[2] == 'h') opdesc |= 0x1;
-            push_byte(opdesc);
-            return true;
-        }
-    }
-    else
-    {
-        if (lexer->match_imm_w(str, token1))
-        {
-            push_byte(Addressing_Mode::Imm);
-            if (token1[0] == '&')
-            {
-                if (insert_reloc(token1.substr(1), R_VN_16, next_instr)) return true;
-            }
-            else
-            {
-                Elf16_Word word;
-                if (!parser->decode_word(token1, word))
-                {
-                    cerr << "ERROR: Failed to decode: '" << token1 << "' as a word value!\n";
-                    return false;
-                }
-                push_word(word);
-                return true;
-            }
-        }
-        else if (lexer->match_regdir_w(str, token1))
-        {
-            Elf16_Half opdesc;
-            if (!parser->decode_register(token1, opdesc))
-            {
-                cerr << "ERROR: Invalid register: '" << token1 << "'!\n";
-                return false;
-            }
-            opdesc |= Addressing_Mode::RegDir;
-            push_byte(opdesc);
-            return true;
-        }
+        store_byte(enc, word & 0xff); // little-endian
+        store_byte(enc, word >> 8);
     }
-    if (lexer->match_regind(str, token1))
+    enc.loc_cnt += sizeof(Elf16_Word);
+}
+
+void Assembler::push_fill(Encoder &enc, Elf16_Half byte, Elf16_Word count)
+{
+    if (enc.sect->header.shdr.sh_type == SHT_PROGBITS) enc.data->fill(byte, count);
+    enc.loc_cnt += count * sizeof(Elf16_Half);
+}
+
+// The relocation section of sect, created on its first relocation
+Section &Assembler::rel_section(Section &sect)
+{
+    if (sect.rel == 0)
+        sect.rel = add_shdr(strings.intern(".rel" + strings.get(sect.name)), SHT_REL, SHF_INFO_LINK, true, sect.header.index, sizeof(Elf16_Rel));
+    return sections[sect.rel];
+}
+
+bool Assembler::insert_operand(Encoder &enc, const Line_Info &info, unsigned i, Elf16_Addr next_instr)
+{
+    if (info.op_size == Operand_Size::None) return false;
+    const Operand &op = info.op[i];
+    uint8_t reg = info.op_reg(i);
+    Symtab_Entry *entry;
+    switch (info.op_type(i))
     {
-        Elf16_Half opdesc;
-        if (!parser->decode_register(token1, opdesc))
-        {
-            cerr << "ERROR: Invalid register: '" << token1 << "'!\n";
-            return false;
-        }
-        opdesc |= Addressing_Mode::RegInd;
-        push_byte(opdesc);
+    case Operand_Type::Imm:
+        push_byte(enc, Addressing_Mode::Imm);
+        if (info.op_size == Operand_Size::Byte) push_byte(enc, op.data);
+        else push_word(enc, op.data);
         return true;
-    }
-    else if (lexer->match_regindoff(str, token1, token2))
-    {
-        Elf16_Half opdesc;
-        if (!parser->decode_register(token1, opdesc))
-        {
-            cerr << "ERROR: Invalid register: '" << token1 << "'!\n";
-            return false;
-        }
-        Elf16_Half byteoff;
-        Elf16_Word wordoff;
-        if (parser->decode_byte(token2, byteoff))
-        {
-            if (byteoff == 0)
-            {
-                opdesc |= Addressing_Mode::RegInd; // zero-offset = regind without offset
-                push_byte(opdesc);
-            }
-            else
-            {
-                opdesc |= Addressing_Mode::RegIndOff8; // 8-bit offset
-                push_byte(opdesc);
-                push_byte(byteoff);
-            }
-        }
-        else if (parser->decode_word(token2, wordoff))
+    case Operand_Type::ImmSym:
+        push_byte(enc, Addressing_Mode::Imm);
+        if (info.op_size == Operand_Size::Word)
         {
-            if (wordoff == 0)
-            {
-                opdesc |= Addressing_Mode::RegInd; // zero-offset = regind without offset
-                push_byte(opdesc);
-            }
-            else
-            {
-                opdesc |= Addressing_Mode::RegIndOff16; // 16-bit offset
-                push_byte(opdesc);
-                push_word(wordoff);
-            }
+            if (insert_reloc(&enc, op.data, R_VN_16, next_instr)) return true;
+            break;
         }
-        else
+        if ((entry = get_symtab_entry(op.data, *enc.errors)) == nullptr) return false;
+        if (entry->sym.st_shndx != SHN_ABS)
         {
-            cerr << "ERROR: Failed to decode: '" << token2 << "' as a byte or word value!\n";
+            *enc.errors << "ERROR: Symbol: '" << strings.get(op.str) << "' is not an absolute symbol and cannot be used for byte-immediate addressing!\n";
             return false;
         }
+        push_byte(enc, entry->sym.st_value & 0xff);
+        if ((int16_t) entry->sym.st_value >= -128 && (int16_t) entry->sym.st_value <= 127) return true;
+        *enc.errors << "ERROR: Value of absolute symbol: '" << strings.get(op.str) << "' is greater than a byte value and cannot be used for byte-immediate addressing!\n";
+        return false;
+    case Operand_Type::RegDir:
+        push_byte(enc, Addressing_Mode::RegDir | reg);
         return true;
-    }
-    else if (lexer->match_regindsym(str, token1, token2))
-    {
-        Elf16_Half opdesc;
-        if (!parser->decode_register(token1, opdesc))
-        {
-            cerr << "ERROR: Invalid register: '" << token1 << "'!\n";
-            return false;
-        }
-        opdesc |= Addressing_Mode::RegIndOff16;
-        push_byte(opdesc);
-        Symtab_Entry entry;
-        if (!get_symtab_entry(token2, entry)) return false;
-        if (entry.sym.st_shndx != SHN_ABS)
-        {
-            cerr << "ERROR: Relative symbol: '" << token2 << "' cannot be used as an offset for register indirect addressing!\n";
-            return false;
-        }
-        push_word(entry.sym.st_value);
+    case Operand_Type::RegInd:
+        push_byte(enc, Addressing_Mode::RegInd | reg);
         return true;
-    }
-    else if (lexer->match_memsym(str, token1))
-    {
-        bool pcrel = token1[0] == '$';
-        push_byte(pcrel ? Addressing_Mode::RegIndOff16 | 7 << 1 : Addressing_Mode::Mem);
-        if (insert_reloc(pcrel ? token1.substr(1) : token1, pcrel ? R_VN_PC16 : R_VN_16, next_instr)) return true;
-    }
-    else if (lexer->match_memabs(str, token1))
-    {
-        Elf16_Word address;
-        if (!parser->decode_word(token1, address))
+    case Operand_Type::RegIndOff8:
+        push_byte(enc, Addressing_Mode::RegIndOff8 | reg);
+        push_byte(enc, op.data);
+        return true;
+    case Operand_Type::RegIndOff16:
+        push_byte(enc, Addressing_Mode::RegIndOff16 | reg);
+        push_word(enc, op.data);
+        return true;
+    case Operand_Type::RegIndSym:
+        push_byte(enc, Addressing_Mode::RegIndOff16 | reg);
+        if ((entry = get_symtab_entry(op.data, *enc.errors)) == nullptr) return false;
+        if (entry->sym.st_shndx != SHN_ABS)
         {
-            cerr << "ERROR: Invalid address: '" << token1 << "'!\n";
+            *enc.errors << "ERROR: Relative symbol: '" << strings.get(op.data) << "' cannot be used as an offset for register indirect addressing!\n";
             return false;
         }
-        push_byte(Addressing_Mode::Mem);
-        push_word(address);
+        push_word(enc, entry->sym.st_value);
+        return true;
+    case Operand_Type::MemSym:
+        push_byte(enc, Addressing_Mode::Mem);
+        if (insert_reloc(&enc, op.data, R_VN_16, next_instr)) return true;
+        break;
+    case Operand_Type::PcRelSym:
+        push_byte(enc, Addressing_Mode::RegIndOff16 | 7 << 1);
+        if (insert_reloc(&enc, op.data, R_VN_PC16, next_instr)) return true;
+        break;
+    case Operand_Type::MemAbs:
+        push_byte(enc, Addressing_Mode::Mem);
+        push_word(enc, op.data);
         return true;
     }
-    cerr << "ERROR: Invalid operand: '" << str << "'!\n";
+    *enc.errors << "ERROR: Invalid operand: '" << strings.get(op.str) << "'!\n";
     return false;
 }
 
-bool Assembler::insert_reloc(const string &symbol, Elf16_Half type, Elf16_Addr next_instr, bool place, std::vector<Reltab_Entry> *relocs_vect)
+// Symbol a relocation against entry refers to: the symbol itself if it is
+// global, otherwise its section. r_info has room for ELF16_R_SYM_MAX of them.
+
+bool Assembler::reloc_symbol(const Symtab_Entry &entry, str_id_t symbol, sym_handle_t &result, std::ostream &errors)
 {
-    Symtab_Entry entry;
-    if (!get_symtab_entry(symbol, entry)) return false;
-    int value;
+    bool global = ELF16_ST_BIND(entry.sym.st_info) == STB_GLOBAL;
+    result = global ? entry.index : sections[entry.sym.st_shndx].symbol;
+    if (result > ELF16_R_SYM_MAX)
+    {
+        errors << "ERROR: " << (global ? "Symbol: '" : "Section symbol of: '") << strings.get(symbol) << "' has index "
+               << result << ", relocations can only refer to the first " << ELF16_R_SYM_MAX + 1 << " symbols!\n";
+        return false;
+    }
+    return true;
+}
+
+// Without relocs_vect the relocation is made for the line enc is encoding,
+// with it only the symbols are collected and enc may be nullptr
+
+bool Assembler::insert_reloc(Encoder *enc, str_id_t symbol, Elf16_Half type, Elf16_Addr next_instr, bool place, std::vector<Reltab_Entry> *relocs_vect)
+{
+    ostream &errors = enc != nullptr ? *enc->errors : this->errors;
+    Symtab_Entry *found = get_symtab_entry(symbol, errors);
+    if (found == nullptr) return false;
+    const Symtab_Entry &entry = *found;
+    int value = 0; // only placed when a relocation is made for the encoded line
     if (entry.sym.st_shndx == SHN_ABS)
     {
         if (type == R_VN_16) value = entry.sym.st_value;
         else
         {
-            cerr << "ERROR: Absolute symbol: '" << symbol << "' cannot be used for memory addressing!\n";
+            errors << "ERROR: Absolute symbol: '" << strings.get(symbol) << "' cannot be used for memory addressing!\n";
             return false;
         }
     }
     else
     {
         bool global = ELF16_ST_BIND(entry.sym.st_info) == STB_GLOBAL;
-        if (type == R_VN_PC16 && !global && entry.sym.st_shndx == cur_sect.shdrtab_index)
+        sym_handle_t rel_sym;
+        if (type == R_VN_PC16 && !global && entry.sym.st_shndx == enc->sect->header.index)
             value = entry.sym.st_value - next_instr;
         else
         {
-            if (entry.is_equ && equ_reloc_map.count(symbol) == 0)
-                return false; // relocs map vector not yet defined, wait for next try
-            if (relocs_vect == nullptr)
+            if (entry.is_equ && entry.expansion == 0)
+                return false; // expansion not yet built, wait for next try
+            const Equ_Expansion *equ = entry.is_equ ? &equ_expansions[entry.expansion] : nullptr;
+            if (equ != nullptr && type == R_VN_PC16 && relocs_vect == nullptr
+                && equ->local_shndx != SHN_UNDEF && equ->local_shndx == enc->sect->header.index)
+                value = equ->addend - next_instr; // relative to the current section, no relocation needed
+            else if (relocs_vect == nullptr)
             {
-                string relshdr = ".rel" + cur_sect.name;
-                add_shdr(relshdr, SHT_REL, SHF_INFO_LINK, true, shdrtab_map.at(cur_sect.name).index, sizeof(Elf16_Rel));
-                if (entry.is_equ)
+                vector<Reltab_Entry> &relocs = enc->relocs != nullptr ? *enc->relocs : rel_section(*enc->sect).relocs;
+                if (equ != nullptr)
                 {
-                    value = equ_reloc_map.at(symbol).first;
-                    for (auto reloc : equ_reloc_map.at(symbol).second)
-                    {
-                        Symtab_Entry &reloc_entry = symtab_map.at(strtab_vect[ELF16_R_SYM(reloc.rel.r_info)]);
-                        if (type == R_VN_PC16 && ELF16_ST_BIND(reloc_entry.sym.st_info) != STB_GLOBAL
-                            && reloc_entry.sym.st_shndx == cur_sect.shdrtab_index) continue;
-                        reltab_map[cur_sect.name].push_back(Reltab_Entry(ELF16_R_INFO(ELF16_R_SYM(reloc.rel.r_info), type), cur_sect.loc_cnt));
-                    }
-                    shdrtab_map.at(relshdr).shdr.sh_size += equ_reloc_map.at(symbol).second.size() * sizeof(Elf16_Rel);
+                    value = equ->addend;
+                    for (Elf16_Word sym : equ->symbols)
+                        relocs.push_back(Reltab_Entry(ELF16_R_INFO(sym, type), enc->loc_cnt));
                 }
                 else
                 {
                     value = global ? 0 : entry.sym.st_value;
-                    reltab_map[cur_sect.name].push_back(Reltab_Entry(ELF16_R_INFO(global ? entry.index : symtab_map.at(shstrtab_vect[entry.sym.st_shndx]).index, type), cur_sect.loc_cnt));
-                    shdrtab_map.at(relshdr).shdr.sh_size += sizeof(Elf16_Rel);
+                    if (!reloc_symbol(entry, symbol, rel_sym, errors)) return false;
+                    relocs.push_back(Reltab_Entry(ELF16_R_INFO(rel_sym, type), enc->loc_cnt));
                 }
-                if (type == R_VN_PC16) value += cur_sect.loc_cnt - next_instr;
+                if (type == R_VN_PC16) value += enc->loc_cnt - next_instr;
             }
-            else if (entry.is_equ)
-                for (auto reloc : equ_reloc_map.at(symbol).second)
-                    relocs_vect->push_back(Reltab_Entry(ELF16_R_INFO(ELF16_R_SYM(reloc.rel.r_info), type), cur_sect.loc_cnt));
+            else if (equ != nullptr)
+                for (Elf16_Word sym : equ->symbols)
+                    relocs_vect->push_back(Reltab_Entry(ELF16_R_INFO(sym, type)));
             else
-                relocs_vect->push_back(Reltab_Entry(ELF16_R_INFO(global ? entry.index : symtab_map.at(shstrtab_vect[entry.sym.st_shndx]).index, type), cur_sect.loc_cnt));
+            {
+                if (!reloc_symbol(entry, symbol, rel_sym, errors)) return false;
+                relocs_vect->push_back(Reltab_Entry(ELF16_R_INFO(rel_sym, type)));
+            }
         }
     }
-    if (place) push_word(value);
+    if (place) push_word(*enc, value);
     return true;
 }
\ No newline at end of file
@@ -1,231 +1,570 @@
 #include "lexer.h"
 
-using std::list;
-using std::regex;
-using std::smatch;
-using std::sregex_token_iterator;
+#include <ostream>
+#include <stdint.h>
+#include <string.h>
+
+using std::ostream;
 using std::string;
 
-Lexer::Lexer()
-{
-    // g++ < 8.1 have a bug with regex::icase and that was messing it up...
-    // source: https://gcc.gnu.org/bugzilla/show_bug.cgi?id=71500#c20
-    empty_rx.assign(empty_str, regex::optimize);
-    line_rx.assign(line_str, regex::optimize);
-    split_rx.assign(split_str, regex::optimize);
-    symbol_rx.assign(symbol_str, regex::optimize);
-    byte_rx.assign(byte_str, regex::optimize);
-    word_rx.assign(word_str, regex::optimize);
-    imm_b_rx.assign(imm_b_str, regex::optimize);
-    imm_w_rx.assign(imm_w_str, regex::optimize);
-    regdir_b_rx.assign(regdir_b_str, regex::optimize);
-    regdir_w_rx.assign(regdir_w_str, regex::optimize);
-    regind_rx.assign(regind_str, regex::optimize);
-    regindoff_rx.assign(regindoff_str, regex::optimize);
-    regindsym_rx.assign(regindsym_str, regex::optimize);
-    memsym_rx.assign(memsym_str, regex::optimize);
-    memabs_rx.assign(memabs_str, regex::optimize);
-    directive_rx.assign(directive_str, regex::optimize);
-    zeroaddr_rx.assign(zeroaddr_str, regex::optimize);
-    oneaddr_rx.assign(oneaddr_str, regex::optimize);
-    twoaddr_rx.assign(twoaddr_str, regex::optimize);
-    expr_rx.assign(expr_str, regex::optimize);
+// *** Character classes ***
+
+#define CC_SPACE    0x01 // [ \t\n\v\f\r]
+#define CC_DIGIT    0x02 // [0-9]
+#define CC_OCT      0x04 // [0-7]
+#define CC_BIN      0x08 // [01]
+#define CC_HEX      0x10 // [0-9a-fA-F]
+#define CC_SYM_HEAD 0x20 // [._a-zA-Z]
+#define CC_SYM_TAIL 0x40 // [._a-zA-Z0-9]
+#define CC_COMMENT  0x80 // [@#;]
+
+static const uint8_t char_class[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x00, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60, 0x00,
+    0x5e, 0x5e, 0x56, 0x56, 0x56, 0x56, 0x56, 0x56, 0x52, 0x52, 0x00, 0x80, 0x00, 0x00, 0x00, 0x00,
+    0x80, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60,
+    0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x00, 0x00, 0x00, 0x00, 0x60,
+    0x00, 0x70, 0x70, 0x70, 0x70, 0x70, 0x70, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60,
+    0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static inline bool is_class(char c, uint8_t cc)
+{
+    return (char_class[(unsigned char) c] & cc) != 0;
 }
 
-string Lexer::tolower(const string &str)
+// *** Scanner primitives ***
+// All of them work on the [p, end) range and return the position where the
+// recognized element ends (or the starting position if nothing was recognized).
+
+static const char *skip_space(const char *p, const char *end)
 {
-    string res = str;
-    for (unsigned j = 0; j < res.length(); ++j)
-        if (res[j] >= 'A' && res[j] <= 'Z')
-            res[j] = (char)(res[j] - 'A' + 'a');
-    return res;
+    while (p < end && is_class(*p, CC_SPACE)) ++p;
+    return p;
 }
 
-bool Lexer::is_empty(const string &str)
+// Moves end back over trailing whitespace, but never before begin
+static const char *trim_space(const char *begin, const char *end)
 {
-    return regex_match(str, empty_rx);
+    while (end > begin && is_class(end[-1], CC_SPACE)) --end;
+    return end;
 }
 
-list<string> Lexer::split_string(const string &str)
+static const char *find_comment(const char *p, const char *end)
 {
-    return Lexer::tokenize_string(str, split_rx);
+    while (p < end && !is_class(*p, CC_COMMENT)) ++p;
+    return p;
 }
 
-bool Lexer::match_symbol(const string &str, string &result)
+// Line END: whitespace, optional comment and then the end of the line
+static bool scan_end(const char *p, const char *end)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, symbol_rx, tokens);
-    if (res) result = tokens[0];
-    return res;
+    p = skip_space(p, end);
+    if (p == end) return true;
+    if (!is_class(*p, CC_COMMENT)) return false;
+    for (++p; p < end; ++p)
+        if (*p == '\n' || (*p == '\r' && p + 1 < end)) return false;
+    return true;
 }
 
-bool Lexer::match_byte(const string &str, string &result)
+// Lowercase keyword (directive or mnemonic name)
+static const char *scan_keyword(const char *p, const char *end)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, byte_rx, tokens);
-    if (res) result = tokens[0];
-    return res;
+    while (p < end && *p >= 'a' && *p <= 'z') ++p;
+    return p;
 }
 
-bool Lexer::match_word(const string &str, string &result)
+static bool is_keyword(const char *p, const char *end, const char *keyword)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, word_rx, tokens);
-    if (res) result = tokens[0];
-    return res;
+    size_t len = strlen(keyword);
+    return (size_t) (end - p) == len && strncmp(p, keyword, len) == 0;
 }
 
-bool Lexer::match_imm_b(const string &str, string &value)
+static const char *scan_symbol(const char *p, const char *end)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, imm_b_rx, tokens);
-    if (res) value = tokens[0];
-    return res;
+    if (p == end || !is_class(*p, CC_SYM_HEAD)) return p;
+    for (++p; p < end && is_class(*p, CC_SYM_TAIL); ++p);
+    return p;
 }
 
-bool Lexer::match_imm_w(const string &str, string &value)
+static const char *scan_digits(const char *p, const char *end, uint8_t cc, unsigned max)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, imm_w_rx, tokens);
-    if (res) value = tokens[0];
-    return res;
+    for (unsigned n = 0; n < max && p < end && is_class(*p, cc); ++n) ++p;
+    return p;
 }
 
-bool Lexer::match_regdir_b(const string &str, string &reg)
+// Byte or word value, picks the first alternative that matches (and the longest one)
+static const char *scan_value(const char *p, const char *end, bool word)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, regdir_b_rx, tokens);
-    if (res) reg = tokens[0];
-    return res;
+    const char *begin = p, *q;
+    if (p < end && (*p == '-' || *p == '~')) ++p;
+    if (p == end) return begin;
+    if (*p == '0')
+    {
+        if (p + 1 < end && (p[1] == 'b' || p[1] == 'B')
+            && (q = scan_digits(p + 2, end, CC_BIN, word ? 16 : 8)) != p + 2) return q;
+        if ((q = scan_digits(p + 1, end, CC_OCT, word ? 6 : 3)) != p + 1) return q;
+        if (p + 1 < end && (p[1] == 'x' || p[1] == 'X')
+            && (q = scan_digits(p + 2, end, CC_HEX, word ? 4 : 2)) != p + 2) return q;
+        return p + 1;
+    }
+    if (is_class(*p, CC_DIGIT)) return scan_digits(p + 1, end, CC_DIGIT, word ? 4 : 2);
+    return begin;
 }
 
-bool Lexer::match_regdir_w(const string &str, string &reg)
+// r[0-7] | sp | pc
+static const char *scan_register(const char *p, const char *end)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, regdir_w_rx, tokens);
-    if (res) reg = tokens[0];
-    return res;
+    if (end - p < 2) return p;
+    if ((p[0] == 'r' && is_class(p[1], CC_OCT))
+        || (p[0] == 's' && p[1] == 'p')
+        || (p[0] == 'p' && p[1] == 'c')) return p + 2;
+    return p;
 }
 
-bool Lexer::match_regind(const string &str, string &reg)
+// *** Whole-range matchers (the range must be trimmed) ***
+
+static bool is_symbol(const char *p, const char *end)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, regind_rx, tokens);
-    if (res) reg = tokens[0];
-    return res;
+    return p < end && scan_symbol(p, end) == end;
+}
+
+static bool is_value(const char *p, const char *end, bool word)
+{
+    return p < end && scan_value(p, end, word) == end;
+}
+
+static bool is_imm(const char *p, const char *end, bool word)
+{
+    return is_value(p, end, word) || (p < end && *p == '&' && is_symbol(p + 1, end));
+}
+
+static bool is_regdir(const char *p, const char *end, bool word)
+{
+    if (word) return end - p == 2 && scan_register(p, end) == end;
+    return end - p == 3 && p[0] == 'r' && is_class(p[1], CC_OCT) && (p[2] == 'h' || p[2] == 'l');
 }
 
-bool Lexer::match_regindoff(const string &str, string &reg, string &offset)
+// [<reg>]
+static bool split_regind(const char *p, const char *end, const char *&reg)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, regindoff_rx, tokens);
-    if (res) 
+    if (p == end || *p != '[') return false;
+    reg = skip_space(p + 1, end);
+    const char *q = scan_register(reg, end);
+    if (q == reg) return false;
+    q = skip_space(q, end);
+    return q + 1 == end && *q == ']';
+}
+
+// <reg>[<offset>], the offset is not validated
+static bool split_regoff(const char *p, const char *end, const char *&off, const char *&off_end)
+{
+    const char *q = scan_register(p, end);
+    if (q == p) return false;
+    q = skip_space(q, end);
+    if (q == end || *q != '[') return false;
+    off = skip_space(q + 1, end);
+    for (off_end = off; off_end < end && *off_end != ']' && !is_class(*off_end, CC_SPACE); ++off_end);
+    q = skip_space(off_end, end);
+    return off < off_end && q + 1 == end && *q == ']';
+}
+
+static bool is_mem(const char *p, const char *end)
+{
+    const char *reg, *off, *off_end;
+    if (p == end) return false;
+    if (split_regind(p, end, reg)) return true;
+    if (split_regoff(p, end, off, off_end))
+        return is_value(off, off_end, true) || is_symbol(off, off_end);
+    if (*p == '*') return is_value(p + 1, end, true);
+    return is_symbol(*p == '$' ? p + 1 : p, end);
+}
+
+static bool is_operand(const char *p, const char *end, uint8_t modes, bool word)
+{
+    return ((modes & ADR_IMM) && is_imm(p, end, word))
+        || ((modes & ADR_REGDIR) && is_regdir(p, end, word))
+        || ((modes & ADR_MEM) && is_mem(p, end));
+}
+
+// *** Token views ***
+
+ostream &operator<<(ostream &out, const Token &token)
+{
+    return out.write(token.data(), token.size());
+}
+
+Comma_Split::iterator::iterator(const char *tok, const char *end, bool first) : tok(tok), next(nullptr), end(end), first(first)
+{
+    if (tok != nullptr) load();
+}
+
+Comma_Split::iterator &Comma_Split::iterator::operator++()
+{
+    tok = next;
+    first = false;
+    if (tok != nullptr) load();
+    return *this;
+}
+
+void Comma_Split::iterator::load()
+{
+    const char *p = tok;
+    while (p < end && *p != ',') ++p;
+    if (p < end)
     {
-        reg = tokens[0];
-        offset = tokens[1];
+        cur = Token(tok, trim_space(tok, p));
+        next = p + 1;
     }
-    return res;
+    else if (first || tok < end)
+    {
+        cur = Token(tok, end);
+        next = nullptr;
+    }
+    else tok = nullptr; // empty trailing token
+}
+
+size_t Comma_Split::size() const
+{
+    size_t cnt = 0;
+    for (iterator it = begin(); it != end(); ++it) ++cnt;
+    return cnt;
 }
 
-bool Lexer::match_regindsym(const string &str, string &reg, string &symbol)
+Expression_Scanner::Expression_Scanner(const Token &str) : p(str.begin()), end(str.end()), first(true)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, regindsym_rx, tokens);
-    if (res)
+    if (p == end) p = nullptr; // empty expression is invalid
+}
+
+bool Expression_Scanner::next(Token &token)
+{
+    if (p == nullptr || p == end) return false;
+    const char *tok = p;
+    for (; tok < end && is_class(*tok, CC_SPACE); ++tok)
+        if (!first && (*tok == '\r' || *tok == '\n')) tok = end; // line breaks are only allowed before the first token
+    if (tok == end)
     {
-        reg = tokens[0];
-        symbol = tokens[1];
+        p = nullptr; // trailing whitespace is invalid
+        return false;
     }
-    return res;
+    const char *q;
+    if ((q = scan_value(tok, end, true)) == tok && (q = scan_symbol(tok, end)) == tok
+        && strchr("()+-*/%&|^", *tok) != nullptr && *tok != '\0') q = tok + 1;
+    if (q == tok)
+    {
+        p = nullptr;
+        return false;
+    }
+    token = Token(tok, q);
+    p = q;
+    first = false;
+    return true;
 }
 
-bool Lexer::match_memsym(const string &str, string &symbol)
+// *** Lexer ***
+
+const Lexer &Lexer::shared()
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, memsym_rx, tokens);
-    if (res) symbol = tokens[0];
-    return res;
+    static const Lexer lexer;
+    return lexer;
 }
 
-bool Lexer::match_memabs(const string &str, string &address)
+string Lexer::tolower(const string &str)
 {
-    tokens_t tokens;
-    bool res = Lexer::tokenize_content(str, memabs_rx, tokens);
-    if (res) address = tokens[0];
+    string res = str;
+    for (unsigned j = 0; j < res.length(); ++j)
+        if (res[j] >= 'A' && res[j] <= 'Z')
+            res[j] = (char)(res[j] - 'A' + 'a');
     return res;
 }
 
-bool Lexer::tokenize_line(const string &str, tokens_t &tokens)
+bool Lexer::is_empty(const Token &str) const
 {
-    smatch m;
-    if (regex_match(str, m, line_rx))
-    {
-        for (unsigned i = 1; i < m.size(); ++i)
-            tokens.push_back(m.str(i));
-        return true;
-    }
-    return false;
+    return scan_end(str.data(), str.data() + str.size());
 }
 
-bool Lexer::tokenize_directive(const string &str, tokens_t &tokens)
+Comma_Split Lexer::split_string(const Token &str) const
 {
-    return Lexer::tokenize_content(str, directive_rx, tokens);
+    return Comma_Split(str);
 }
 
-bool Lexer::tokenize_zeroaddr(const string &str, tokens_t &tokens)
+bool Lexer::match_symbol(const Token &str, Token &result) const
 {
-    return Lexer::tokenize_content(str, zeroaddr_rx, tokens);
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_symbol(p, end)) return false;
+    result = Token(p, end);
+    return true;
 }
 
-bool Lexer::tokenize_oneaddr(const string &str, tokens_t &tokens)
+bool Lexer::match_byte(const Token &str, Token &result) const
 {
-    return Lexer::tokenize_content(str, oneaddr_rx, tokens, true);
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_value(p, end, false)) return false;
+    result = Token(p, end);
+    return true;
 }
 
-bool Lexer::tokenize_twoaddr(const string &str, tokens_t &tokens)
+bool Lexer::match_word(const Token &str, Token &result) const
 {
-    return Lexer::tokenize_content(str, twoaddr_rx, tokens, true);
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_value(p, end, true)) return false;
+    result = Token(p, end);
+    return true;
 }
 
-bool Lexer::tokenize_expression(const string &str, tokens_t &tokens)
+bool Lexer::match_imm_b(const Token &str, Token &value) const
 {
-    smatch m;
-    string tmp = str;
-    bool valid = false;
-    while (!tmp.empty())
-        if (!regex_match(tmp, m, expr_rx)) break;
-        else
-        {
-            tokens.push_back(m.str(2));
-            tmp = tmp.substr(m.str(1).length());
-            if (tmp.empty()) valid = true;
-        }
-    return valid;
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_imm(p, end, false)) return false;
+    value = Token(p, end);
+    return true;
+}
+
+bool Lexer::match_imm_w(const Token &str, Token &value) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_imm(p, end, true)) return false;
+    value = Token(p, end);
+    return true;
+}
+
+bool Lexer::match_regdir_b(const Token &str, Token &reg) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_regdir(p, end, false)) return false;
+    reg = Token(p, end);
+    return true;
+}
+
+bool Lexer::match_regdir_w(const Token &str, Token &reg) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (!is_regdir(p, end, true)) return false;
+    reg = Token(p, end);
+    return true;
+}
+
+bool Lexer::match_regind(const Token &str, Token &reg) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end), *r;
+    end = trim_space(p, end);
+    if (!split_regind(p, end, r)) return false;
+    reg = Token(r, r + 2);
+    return true;
+}
+
+bool Lexer::match_regindoff(const Token &str, Token &reg, Token &offset) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end), *off, *off_end;
+    end = trim_space(p, end);
+    if (!split_regoff(p, end, off, off_end) || !is_value(off, off_end, true)) return false;
+    reg = Token(p, p + 2);
+    offset = Token(off, off_end);
+    return true;
+}
+
+bool Lexer::match_regindsym(const Token &str, Token &reg, Token &symbol) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end), *off, *off_end;
+    end = trim_space(p, end);
+    if (!split_regoff(p, end, off, off_end) || !is_symbol(off, off_end)) return false;
+    reg = Token(p, p + 2);
+    symbol = Token(off, off_end);
+    return true;
+}
+
+bool Lexer::match_memsym(const Token &str, Token &symbol) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (p == end || !is_symbol(*p == '$' ? p + 1 : p, end)) return false;
+    symbol = Token(p, end);
+    return true;
 }
 
-list<string> Lexer::tokenize_string(const string &str, const regex &regex)
+bool Lexer::match_memabs(const Token &str, Token &address) const
 {
-    list<string> tokens;
-    sregex_token_iterator it(str.begin(), str.end(), regex, -1), reg_end;
-    for (; it != reg_end; ++it)
-        tokens.emplace_back(it->str());
-    return tokens;
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    end = trim_space(p, end);
+    if (p == end || *p != '*' || !is_value(p + 1, end, true)) return false;
+    address = Token(p + 1, end);
+    return true;
 }
 
-bool Lexer::tokenize_content(const string &str, const regex &regex, tokens_t &tokens, bool ignore_second)
+bool Lexer::tokenize_line(const Token &str, tokens_t &tokens) const
 {
-    smatch m;
-    if (regex_match(str, m, regex))
+    // [<label>:] [<content>] [<comment>]
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end), *label = p;
+    const char *q = scan_symbol(p, end), *label_end = label;
+    if (q != p && q < end && *q == ':')
     {
-        unsigned i = 1;
-        while (i < m.size() && m.str(i).empty()) i++;
-        if (i == m.size()) return false;
-        tokens.push_back(m.str(i++));
-        if (!ignore_second && m.str(i).empty()) return true;
-        tokens.push_back(m.str(i++));
-        for (; i < m.size() && !m.str(i).empty(); ++i)
-            tokens.push_back(m.str(i));
+        label_end = q;
+        p = q + 1;
+    }
+    p = skip_space(p, end);
+    q = trim_space(p, find_comment(p, end));
+    if (!scan_end(q, end)) return false;
+    tokens.push_back(Token(label, label_end));
+    tokens.push_back(Token(p, q));
+    return true;
+}
+
+bool Lexer::tokenize_directive(const Token &str, tokens_t &tokens) const
+{
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end);
+    if (p == end || *p != '.') return false;
+    const char *name = p + 1, *name_end = scan_keyword(name, end), *arg, *arg_end;
+    p = skip_space(name_end, end);
+    bool sep = p != name_end; // directive name and parameters must be separated
+
+    if (is_keyword(name, name_end, "section"))
+    {   // .section <symbol>[, "<flags>"]
+        // flags: a-allocatable, e-excluded from executable and shared library (bss), w-writable, x-executable
+        if (!sep || (arg_end = scan_symbol(p, end)) == p) return false;
+        arg = p;
+        p = skip_space(arg_end, end);
+        const char *flags = p, *flags_end = p;
+        if (p < end && *p == ',')
+        {
+            const char *q = skip_space(p + 1, end);
+            if (q < end && *q == '"')
+            {
+                const char *f = ++q;
+                for (const char *order = "aewx"; *order != '\0'; ++order)
+                    if (q < end && *q == *order) ++q;
+                if (q < end && *q == '"')
+                {
+                    flags = f;
+                    flags_end = q;
+                    p = q + 1;
+                }
+            }
+        }
+        if (!scan_end(p, end)) return false;
+        tokens.push_back(Token(name, name_end));
+        tokens.push_back(Token(arg, arg_end));
+        if (flags != flags_end) tokens.push_back(Token(flags, flags_end));
+        return true;
+    }
+    if (is_keyword(name, name_end, "text") || is_keyword(name, name_end, "data")
+        || is_keyword(name, name_end, "bss") || is_keyword(name, name_end, "end"))
+    {   // .text | .data | .bss | .end
+        if (!scan_end(name_end, end)) return false;
+        tokens.push_back(Token(name, name_end));
+        return true;
+    }
+    if (is_keyword(name, name_end, "global") || is_keyword(name, name_end, "extern")
+        || is_keyword(name, name_end, "byte") || is_keyword(name, name_end, "word"))
+    {   // .global | .extern | .byte | .word <content>
+        if (!sep) return false;
+        arg_end = trim_space(p, find_comment(p, end));
+        if (!scan_end(arg_end, end)) return false;
+        tokens.push_back(Token(name, name_end));
+        if (p != arg_end) tokens.push_back(Token(p, arg_end));
+        return true;
+    }
+    if (is_keyword(name, name_end, "equ") || is_keyword(name, name_end, "set"))
+    {   // .equ | .set <symbol>, <content>
+        if (!sep || (arg_end = scan_symbol(p, end)) == p || arg_end == end || *arg_end != ',') return false;
+        arg = p;
+        p = skip_space(arg_end + 1, end);
+        const char *expr_end = trim_space(p, find_comment(p, end));
+        if (!scan_end(expr_end, end)) return false;
+        tokens.push_back(Token(name, name_end));
+        tokens.push_back(Token(arg, arg_end));
+        if (p != expr_end) tokens.push_back(Token(p, expr_end));
+        return true;
+    }
+    bool align = is_keyword(name, name_end, "align");
+    if (align || is_keyword(name, name_end, "skip"))
+    {   // .align <byte>[, <byte>[, <byte>]] | .skip <word>[, <byte>]
+        const char *params[3][2];
+        unsigned cnt = 0, max = align ? 3 : 2;
+        if (!sep) return false;
+        for (const char *q = p; cnt < max; ++cnt)
+        {
+            if (cnt > 0)
+            {   // optional parameter: [<ws>], <ws> <value>
+                q = skip_space(p, end);
+                if (q == end || *q != ',') break;
+                q = skip_space(q + 1, end);
+            }
+            const char *v = q;
+            while (v < end && *v != ',' && !is_class(*v, CC_SPACE | CC_COMMENT)) ++v;
+            if (!is_value(q, v, !align && cnt == 0))
+            {
+                if (cnt == 0) return false;
+                break;
+            }
+            params[cnt][0] = q;
+            params[cnt][1] = p = v;
+        }
+        if (!scan_end(p, end)) return false;
+        tokens.push_back(Token(name, name_end));
+        for (unsigned i = 0; i < cnt; ++i)
+            tokens.push_back(Token(params[i][0], params[i][1]));
         return true;
     }
     return false;
+}
+
+bool Lexer::tokenize_instruction(const Token &str, tokens_t &tokens) const
+{
+    // <mnemonic> [<operand> [, <operand>]...], the operands are not validated
+    const char *end = str.data() + str.size();
+    const char *p = skip_space(str.data(), end), *name = p;
+    const char *name_end = scan_keyword(p, end);
+    if (name == name_end) return false;
+    p = skip_space(name_end, end);
+    const char *op_end = trim_space(p, find_comment(p, end));
+    if (!scan_end(op_end, end)) return false;
+    tokens.push_back(Token(name, name_end));
+    if (p == op_end) return true; // no operands
+    if (p == name_end) return false; // mnemonic and operands must be separated
+    for (const char *op = p; ; op = skip_space(p + 1, op_end))
+    {
+        for (p = op; p < op_end && *p != ','; ++p);
+        tokens.push_back(Token(op, trim_space(op, p)));
+        if (p == op_end) return true;
+    }
+}
+
+bool Lexer::match_operand(const Token &str, uint8_t modes, bool word) const
+{
+    return is_operand(str.data(), str.data() + str.size(), modes, word);
+}
+
+Expression_Scanner Lexer::tokenize_expression(const Token &str) const
+{
+    return Expression_Scanner(str);
 }
\ No newline at end of file
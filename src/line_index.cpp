@@ -0,0 +1,152 @@
+#include "line_index.h"
+
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LINE_INDEX_X86
+#include <immintrin.h>
+#endif
+
+#define NONE UINT32_MAX
+
+// *** Scan state ***
+// Offsets of the current line, filled in as the blocks go by. Every block
+// delivers three bit masks (one bit per byte): newlines, comment characters
+// and non-whitespace characters.
+
+typedef struct Scan_State
+{
+    const char      *buf;
+    line_index_t    &lines;
+    uint32_t        begin, content, comment;
+    Scan_State(const char *buf, line_index_t &lines) : buf(buf), lines(lines), begin(0), content(NONE), comment(NONE) {}
+} Scan_State;
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+static inline bool is_comment(char c)
+{
+    return c == '@' || c == '#' || c == ';';
+}
+
+static inline unsigned lowest_bit(uint32_t mask)
+{
+    return __builtin_ctz(mask);
+}
+
+static void end_line(Scan_State &st, uint32_t end)
+{
+    Line_Span span;
+    span.begin      = st.begin;
+    span.end        = end;
+    span.content    = st.content == NONE ? end : st.content;
+    span.comment    = st.comment == NONE ? end : st.comment;
+    if (span.comment < end && memchr(st.buf + span.comment, '\r', end - 1 - span.comment) != nullptr)
+    {   // '\r' inside a comment makes the line invalid, let the lexer see all of it
+        span.content = span.begin;
+        span.comment = end;
+    }
+    st.lines.push_back(span);
+    st.begin    = end + 1;
+    st.content  = NONE;
+    st.comment  = NONE;
+}
+
+// Consumes one block of up to 32 bytes starting at base
+static inline void scan_block(Scan_State &st, uint32_t base, uint32_t nl, uint32_t cm, uint32_t ns)
+{
+    for (;;)
+    {
+        uint32_t before = nl ? (nl & -nl) - 1 : ~0u; // bytes before the next newline
+        if (st.content == NONE && (ns & before)) st.content = base + lowest_bit(ns & before);
+        if (st.comment == NONE && (cm & before)) st.comment = base + lowest_bit(cm & before);
+        if (!nl) return;
+        end_line(st, base + lowest_bit(nl));
+        uint32_t keep = ~((nl & -nl) | before);
+        nl &= keep;
+        cm &= keep;
+        ns &= keep;
+    }
+}
+
+static void scan_tail(Scan_State &st, size_t from, size_t len)
+{
+    for (size_t i = from; i < len; ++i)
+    {
+        char c = st.buf[i];
+        if (c == '\n') end_line(st, i);
+        else if (!is_space(c))
+        {
+            if (st.content == NONE) st.content = i;
+            if (st.comment == NONE && is_comment(c)) st.comment = i;
+        }
+    }
+}
+
+#ifdef LINE_INDEX_X86
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(Scan_State &st, size_t len)
+{
+    const __m128i nl_v = _mm_set1_epi8('\n'), at_v = _mm_set1_epi8('@'), hash_v = _mm_set1_epi8('#');
+    const __m128i semi_v = _mm_set1_epi8(';'), sp_v = _mm_set1_epi8(' ');
+    const __m128i tab_v = _mm_set1_epi8('\t'), ws_range_v = _mm_set1_epi8('\r' - '\t');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *) (st.buf + i));
+        __m128i off = _mm_sub_epi8(c, tab_v); // [\t-\r] <=> (c - '\t') <= 4 unsigned
+        __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(c, sp_v), _mm_cmpeq_epi8(_mm_min_epu8(off, ws_range_v), off));
+        __m128i cm = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(c, at_v), _mm_cmpeq_epi8(c, hash_v)), _mm_cmpeq_epi8(c, semi_v));
+        scan_block(st, i, _mm_movemask_epi8(_mm_cmpeq_epi8(c, nl_v)), _mm_movemask_epi8(cm), ~_mm_movemask_epi8(ws) & 0xffff);
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(Scan_State &st, size_t len)
+{
+    const __m256i nl_v = _mm256_set1_epi8('\n'), at_v = _mm256_set1_epi8('@'), hash_v = _mm256_set1_epi8('#');
+    const __m256i semi_v = _mm256_set1_epi8(';'), sp_v = _mm256_set1_epi8(' ');
+    const __m256i tab_v = _mm256_set1_epi8('\t'), ws_range_v = _mm256_set1_epi8('\r' - '\t');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i c = _mm256_loadu_si256((const __m256i *) (st.buf + i));
+        __m256i off = _mm256_sub_epi8(c, tab_v);
+        __m256i ws = _mm256_or_si256(_mm256_cmpeq_epi8(c, sp_v), _mm256_cmpeq_epi8(_mm256_min_epu8(off, ws_range_v), off));
+        __m256i cm = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(c, at_v), _mm256_cmpeq_epi8(c, hash_v)), _mm256_cmpeq_epi8(c, semi_v));
+        scan_block(st, i, _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, nl_v)), _mm256_movemask_epi8(cm), ~_mm256_movemask_epi8(ws));
+    }
+    return i;
+}
+
+#endif
+
+int line_scan_supported()
+{
+#ifdef LINE_INDEX_X86
+    static const int level = __builtin_cpu_supports("avx2") ? Line_Scan::AVX2
+        : __builtin_cpu_supports("sse2") ? Line_Scan::SSE2 : Line_Scan::Scalar;
+    return level;
+#else
+    return Line_Scan::Scalar;
+#endif
+}
+
+void index_lines(const char *buf, size_t len, line_index_t &lines, int scan)
+{
+    lines.clear();
+    Scan_State st(buf, lines);
+    size_t done = 0;
+    if (scan == Line_Scan::Auto || scan > line_scan_supported()) scan = line_scan_supported();
+#ifdef LINE_INDEX_X86
+    if (scan == Line_Scan::AVX2) done = scan_avx2(st, len);
+    else if (scan == Line_Scan::SSE2) done = scan_sse2(st, len);
+#endif
+    scan_tail(st, done, len);
+    end_line(st, len);
+}
\ No newline at end of file
@@ -1,22 +1,38 @@
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "assembler.h"
+#include "parallel.h"
 
 using std::cerr;
 using std::cout;
 using std::ifstream;
 using std::ofstream;
+using std::ostream;
 using std::string;
+using std::vector;
+
+#define RESPONSE_FILE_DEPTH 8
+#define MAX_JOBS            256
 
 void show_usage(const string &program_name)
 {
     cout << "Usage: " << program_name << " [options] file...\n";
+    cout << "Files and options can also be read from @<file>, separated by whitespace.\n";
     cout << "Options:\n";
-    // Not implemented yet
-    // cout << "  -e\t\tOutput in binary format for use in the provided emulator.\n";
-    cout << "  -o <file>\tPlace the output into <file>.\n";
+    cout << "  -e\t\tOutput in binary format for use in the provided emulator.\n";
+    cout << "  -j <n>\t\tAssemble up to <n> files at once, or parse and encode a single file on <n> threads (default 1).\n";
+    cout << "  -l <file>\tWrite a listing (location counter, bytes, source) into <file> (single input file only).\n";
+    cout << "  -o <file>\tPlace the output into <file> (single input file only).\n";
+    cout << "  -q\t\tPrint errors only.\n";
+    cout << "  -s\t\tAssemble in a single pass, patching symbol references at the end.\n";
+    cout << "  -v\t\tEcho every line as it is assembled.\n";
 }
 
 bool file_exists(const string &name)
@@ -44,6 +60,69 @@ string get_output_file(const string &input_file)
     return input_file.substr(0, lastdot) + ".o";
 }
 
+typedef struct File_Result
+{
+    std::ostringstream  messages, errors;
+    bool                done;
+    File_Result() : done(false) {}
+} File_Result;
+
+// Returns the exit status if the output file cannot be written, 0 otherwise
+int check_output_file(const string &output_file, ostream &errors)
+{
+    if (!std::ofstream(output_file)) // invalid output file
+    {
+        errors << "ERROR: Output file: " << output_file << " cannot be opened for writing!\n";
+        return 3;
+    }
+    return 0;
+}
+
+// Assembles one file whose output file was checked
+void assemble_file(const string &input_file, const string &output_file, const Assembler_Options &options, ostream &messages, ostream &errors)
+{
+    Assembler assembler(input_file, output_file, options, messages, errors);
+    if (!assembler.assemble())
+    {
+        errors << "ERROR: Failed to assemble: " << input_file << "!\n";
+        return;
+    }
+    if (options.verbosity != Verbosity::Quiet)
+        messages << "Successfully assembled: " << input_file << "!\n";
+}
+
+// Replaces every @file argument with the whitespace separated arguments in the file
+bool expand_response_files(vector<string> &args, unsigned depth = 0)
+{
+    vector<string> expanded;
+    for (const string &arg : args)
+    {
+        if (arg.size() < 2 || arg[0] != '@')
+        {
+            expanded.push_back(arg);
+            continue;
+        }
+        ifstream file(arg.substr(1));
+        if (!file)
+        {
+            cerr << "ERROR: Response file: " << arg.substr(1) << " cannot be opened for reading!\n";
+            return false;
+        }
+        if (depth == RESPONSE_FILE_DEPTH)
+        {
+            cerr << "ERROR: Response files nested too deep: " << arg.substr(1) << "!\n";
+            return false;
+        }
+        vector<string> nested;
+        string token;
+        while (file >> token) nested.push_back(token);
+        if (!expand_response_files(nested, depth + 1)) return false;
+        expanded.insert(expanded.end(), nested.begin(), nested.end());
+    }
+    args.swap(expanded);
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) // zero arguments
@@ -53,54 +132,134 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    string input_file, output_file;
-    bool eflag = false;
+    vector<string> args(argv + 1, argv + argc), input_files;
+    string output_file;
+    Assembler_Options options;
+    unsigned jobs = 1;
+
+    if (!expand_response_files(args)) return 1;
 
-    for (int i = 1; i < argc; ++i)
+    for (unsigned i = 0; i < args.size(); ++i)
     {
-        // Not implemented yet
-        // if (string(argv[i]) == "-e")
-        //     eflag = true; // set -e flag
-        // else if (string(argv[i]) == "-o")
-        if (string(argv[i]) == "-o")
+        if (args[i] == "-e")
+            options.binary = true; // set -e flag
+        else if (args[i] == "-s")
+            options.single_pass = true; // set -s flag
+        else if (args[i] == "-q")
+            options.verbosity = Verbosity::Quiet; // set -q flag
+        else if (args[i] == "-v")
+            options.verbosity = Verbosity::Verbose; // set -v flag
+        else if (args[i] == "-l")
         {
-            if (i == argc - 1) // -o flag is the last argument
+            if (i == args.size() - 1) // -l flag is the last argument
             {
-                cerr << "ERROR: Invalid output file switch position!\n";
+                cerr << "ERROR: Invalid listing file switch position!\n";
                 show_usage(argv[0]);
                 return 1;
             }
-            output_file = argv[++i]; // set output file
+            options.listing_file = args[++i]; // set listing file
         }
-        else if (input_file.empty())
-            input_file = argv[i]; // set input file
-        else
+        else if (args[i] == "-j")
         {
-            cerr << "ERROR: Invalid number of input files!\n";
-            show_usage(argv[0]);
-            return 1;
+            if (i == args.size() - 1) // -j flag is the last argument
+            {
+                cerr << "ERROR: Invalid job count switch position!\n";
+                show_usage(argv[0]);
+                return 1;
+            }
+            char *end;
+            unsigned long value = strtoul(args[++i].c_str(), &end, 10);
+            if (*end != '\0' || value == 0 || value > MAX_JOBS)
+            {
+                cerr << "ERROR: Invalid job count: " << args[i] << "! Expected 1 to " << MAX_JOBS << "!\n";
+                return 1;
+            }
+            jobs = value; // set job count
         }
+        else if (args[i] == "-o")
+        {
+            if (i == args.size() - 1) // -o flag is the last argument
+            {
+                cerr << "ERROR: Invalid output file switch position!\n";
+                show_usage(argv[0]);
+                return 1;
+            }
+            output_file = args[++i]; // set output file
+        }
+        else
+            input_files.push_back(args[i]); // add input file
     }
 
-    if (!std::ifstream(input_file)) // invalid input file
+    if (input_files.empty())
     {
-        cerr << "ERROR: Input file: " << input_file << " does not exist or cannot be opened for reading!\n";
-        return 2;
+        cerr << "ERROR: No input file!\n";
+        show_usage(argv[0]);
+        return 1;
     }
-    if (output_file.empty()) // try getting output file name from input file
-        output_file = get_output_file(input_file);
-    if (!std::ofstream(output_file)) // invalid output file
+    if (input_files.size() > 1 && (!output_file.empty() || !options.listing_file.empty()))
     {
-        cerr << "ERROR: Output file: " << output_file << " cannot be opened for writing!\n";
-        return 3;
+        cerr << "ERROR: Cannot use -o or -l with multiple input files!\n";
+        show_usage(argv[0]);
+        return 1;
     }
+    for (const string &input_file : input_files)
+        if (access(input_file.c_str(), R_OK) != 0) // invalid input file, checked without opening it
+        {
+            cerr << "ERROR: Input file: " << input_file << " does not exist or cannot be opened for reading!\n";
+            return 2;
+        }
 
-    Assembler assembler(input_file, output_file, eflag);
-    if (!assembler.assemble())
+    if (input_files.size() == 1) options.threads = jobs; // nothing else to run at once
+
+    if (jobs == 1 || input_files.size() == 1)
     {
-        cerr << "ERROR: Failed to assemble: " << input_file << "!\n";
+        for (const string &input_file : input_files)
+        {
+            string file = output_file.empty() ? get_output_file(input_file) : output_file;
+            int status = check_output_file(file, cerr);
+            if (status != 0) return status;
+            assemble_file(input_file, file, options, cout, cerr);
+        }
         return 0;
     }
-    cout << "Successfully assembled: " << input_file << "!\n";
-    return 0;
+
+    // A sequential run stops at the first output file that cannot be written,
+    // so the output files are checked in input order and only the files before
+    // the first bad one are assembled. The same files are written either way.
+    size_t count = 0;
+    int status = 0;
+    std::ostringstream open_errors;
+    for (; count < input_files.size(); ++count)
+        if ((status = check_output_file(get_output_file(input_files[count]), open_errors)) != 0) break;
+
+    // Every file collects its messages, they are printed in input order as soon
+    // as all files before it are done, so the output does not depend on timing
+    vector<File_Result> results(count);
+    std::mutex print_lock;
+    size_t printed = 0;
+    parallel_for(jobs, count, [&](size_t i)
+    {
+        File_Result &result = results[i];
+        assemble_file(input_files[i], get_output_file(input_files[i]), options, result.messages, result.errors);
+        std::lock_guard<std::mutex> guard(print_lock);
+        result.done = true;
+        for (; printed < results.size() && results[printed].done; ++printed)
+        {
+            File_Result &next = results[printed];
+            cout << next.messages.str();
+            if (next.errors.tellp() > 0)
+            {
+                cout.flush();
+                cerr << next.errors.str();
+            }
+            next.messages.str(string());
+            next.errors.str(string());
+        }
+    });
+    if (status != 0)
+    {
+        cout.flush();
+        cerr << open_errors.str();
+    }
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,90 @@
+#include "parallel.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+// Indices not taken yet by a thread
+typedef struct Work_Range
+{
+    mutex   lock;
+    size_t  begin, end;
+} Work_Range;
+
+static bool take(Work_Range &range, size_t &index)
+{
+    unique_lock<mutex> guard(range.lock);
+    if (range.begin == range.end) return false;
+    index = range.begin++;
+    return true;
+}
+
+// Moves the back half of the largest other range into own, false if no work is left
+static bool steal(vector<Work_Range> &ranges, unsigned self)
+{
+    for (;;)
+    {
+        unsigned victim = self;
+        size_t largest = 0;
+        for (unsigned i = 0; i < ranges.size(); ++i)
+        {
+            if (i == self) continue;
+            unique_lock<mutex> guard(ranges[i].lock);
+            if (ranges[i].end - ranges[i].begin > largest)
+            {
+                largest = ranges[i].end - ranges[i].begin;
+                victim = i;
+            }
+        }
+        if (victim == self) return false;
+
+        size_t begin, end;
+        {
+            unique_lock<mutex> guard(ranges[victim].lock);
+            size_t left = ranges[victim].end - ranges[victim].begin;
+            if (left == 0) continue; // Taken meanwhile, look again
+            end = ranges[victim].end;
+            begin = end - (left + 1) / 2;
+            ranges[victim].end = begin;
+        }
+        unique_lock<mutex> guard(ranges[self].lock);
+        ranges[self].begin = begin;
+        ranges[self].end = end;
+        return true;
+    }
+}
+
+void parallel_for(unsigned threads, size_t count, const std::function<void(size_t)> &body)
+{
+    if (threads > count) threads = count;
+    if (threads <= 1)
+    {
+        for (size_t i = 0; i < count; ++i) body(i);
+        return;
+    }
+
+    vector<Work_Range> ranges(threads);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        ranges[i].begin = count * i / threads;
+        ranges[i].end = count * (i + 1) / threads;
+    }
+
+    auto work = [&ranges, &body](unsigned self)
+    {
+        size_t index;
+        do
+            while (take(ranges[self], index)) body(index);
+        while (steal(ranges, self));
+    };
+
+    vector<thread> workers;
+    for (unsigned i = 1; i < threads; ++i) workers.emplace_back(work, i);
+    work(0);
+    for (thread &worker : workers) worker.join();
+}
\ No newline at end of file
@@ -1,14 +1,89 @@
 #include "parser.h"
 #include "elf.h"
+#include "keywords.h"
 
 using std::string;
 using std::vector;
 
-Expression_Token::Expression_Token(const Expression_Token &t) : type(t.type) {}
-Expression_Token::Expression_Token(Token_Type type) : type(type) {}
-
-Operator_Token::Operator_Token(const Operator_Token &t) : Expression_Token(Operator), op_type(t.op_type) {}
-Operator_Token::Operator_Token(Operator_Type op_type) : Expression_Token(Operator), op_type(op_type) {}
+// Directive keywords, indexed by Directive::code
+static constexpr Keyword dir_kw[DIR_CNT] = {
+    { "global", Directive::Global, false }, { "extern", Directive::Extern, false }, { "equ", Directive::Equ, false },
+    { "set", Directive::Set, false }, { "text", Directive::Text, false }, { "data", Directive::Data, false },
+    { "bss", Directive::Bss, false }, { "section", Directive::Section, false }, { "end", Directive::End, false },
+    { "byte", Directive::Byte, false }, { "word", Directive::Word, false }, { "align", Directive::Align, false },
+    { "skip", Directive::Skip, false }
+};
+
+// Instruction keywords, indexed by Instruction::code, followed by the pseudo-instructions
+static constexpr Keyword instr_kw[INSTR_CNT + PSEUDO_CNT] = {
+    { "nop", Instruction::Nop, false }, { "halt", Instruction::Halt, false }, { "xchg", Instruction::Xchg, true },
+    { "int", Instruction::Int, false }, { "mov", Instruction::Mov, true }, { "add", Instruction::Add, true },
+    { "sub", Instruction::Sub, true }, { "mul", Instruction::Mul, true }, { "div", Instruction::Div, true },
+    { "cmp", Instruction::Cmp, true }, { "not", Instruction::Not, true }, { "and", Instruction::And, true },
+    { "or", Instruction::Or, true }, { "xor", Instruction::Xor, true }, { "test", Instruction::Test, true },
+    { "shl", Instruction::Shl, true }, { "shr", Instruction::Shr, true }, { "push", Instruction::Push, true },
+    { "pop", Instruction::Pop, true }, { "jmp", Instruction::Jmp, false }, { "jeq", Instruction::Jeq, false },
+    { "jne", Instruction::Jne, false }, { "jgt", Instruction::Jgt, false }, { "call", Instruction::Call, false },
+    { "ret", Instruction::Ret, false }, { "iret", Instruction::Iret, false },
+    { "pushf", Instruction::Push, false }, // pushf <=> push psw
+    { "popf", Instruction::Pop, false }    // popf <=> pop psw
+};
+
+// *** Operand grammars, indexed like instr_kw ***
+
+typedef struct Instruction_Grammar
+{
+    uint8_t op_cnt;     // number of operands written in the source
+    uint8_t alt_cnt;    // number of allowed operand combinations
+    uint8_t op[2][2];   // allowed addressing modes (ADR_*) of op1/op2 for each combination
+} Instruction_Grammar;
+
+#define XCHG_GRAMMAR 2, 2, { { ADR_REGDIR | ADR_MEM, ADR_REGDIR }, { ADR_REGDIR, ADR_REGDIR | ADR_MEM } }
+#define ARITH_GRAMMAR 2, 2, { { ADR_REGDIR | ADR_MEM, ADR_IMM | ADR_REGDIR }, { ADR_REGDIR, ADR_REGDIR | ADR_MEM } }
+#define SHIFT_GRAMMAR 2, 1, { { ADR_REGDIR | ADR_MEM, ADR_IMM | ADR_REGDIR } }
+
+static const Instruction_Grammar instr_grammar[INSTR_CNT + PSEUDO_CNT] = {
+    { 0, 0, { } },                          // nop
+    { 0, 0, { } },                          // halt
+    { XCHG_GRAMMAR },                       // xchg
+    { 1, 1, { { ADR_IMM } } },              // int (always a byte operand)
+    { ARITH_GRAMMAR },                      // mov
+    { ARITH_GRAMMAR },                      // add
+    { ARITH_GRAMMAR },                      // sub
+    { ARITH_GRAMMAR },                      // mul
+    { ARITH_GRAMMAR },                      // div
+    { ARITH_GRAMMAR },                      // cmp
+    { 1, 1, { { ADR_REGDIR | ADR_MEM } } }, // not
+    { ARITH_GRAMMAR },                      // and
+    { ARITH_GRAMMAR },                      // or
+    { ARITH_GRAMMAR },                      // xor
+    { ARITH_GRAMMAR },                      // test
+    { SHIFT_GRAMMAR },                      // shl
+    { SHIFT_GRAMMAR },                      // shr
+    { 1, 1, { { ADR_IMM | ADR_REGDIR | ADR_MEM } } }, // push
+    { 1, 1, { { ADR_REGDIR | ADR_MEM } } }, // pop
+    { 1, 1, { { ADR_MEM } } },              // jmp
+    { 1, 1, { { ADR_MEM } } },              // jeq
+    { 1, 1, { { ADR_MEM } } },              // jne
+    { 1, 1, { { ADR_MEM } } },              // jgt
+    { 1, 1, { { ADR_MEM } } },              // call
+    { 0, 0, { } },                          // ret
+    { 0, 0, { } },                          // iret
+    { 0, 0, { } },                          // pushf (push psw is not allowed but it is coded)
+    { 0, 0, { } }                           // popf (pop psw is not allowed but it is coded)
+};
+
+#undef XCHG_GRAMMAR
+#undef ARITH_GRAMMAR
+#undef SHIFT_GRAMMAR
+
+typedef Keyword_Table<dir_kw, DIR_CNT, 3763, 4> dir_table;
+typedef Keyword_Table<instr_kw, INSTR_CNT + PSEUDO_CNT, 15950560, 7> instr_table;
+
+static_assert(dir_table::perfect, "Directive keyword seed causes collisions!");
+static_assert(instr_table::perfect, "Instruction keyword seed causes collisions!");
+
+Operator_Token::Operator_Token(Operator_Type op_type) : op_type(op_type) {}
 
 char Operator_Token::get_symbol()
 {
@@ -35,6 +110,11 @@ int Operator_Token::priority()
     return 0;
 }
 
+bool Operator_Token::divides()
+{
+    return op_type == Div || op_type == Mod;
+}
+
 int Operator_Token::calculate(unsigned a, unsigned b)
 {
     if (op_type == Or) return a | b;
@@ -44,7 +124,7 @@ int Operator_Token::calculate(unsigned a, unsigned b)
     if (op_type == Sub) return a - b;
     if (op_type == Mul) return a * b;
     if (op_type == Div) return (b == 0 ? -1 : a / b);
-    if (op_type == Mod) return a % b;
+    if (op_type == Mod) return (b == 0 ? -1 : a % b);
     return -1;
 }
 
@@ -75,86 +155,32 @@ int Operator_Token::get_clidx(int clidx_a, int clidx_b)
     return clidx_a + clidx_b;
 }
 
-Number_Token::Number_Token(const Number_Token &t) : Expression_Token(Number), value(t.value) {}
-Number_Token::Number_Token(int value) : Expression_Token(Number), value(value) {}
-
-Symbol_Token::Symbol_Token(const Symbol_Token &t) : Expression_Token(Symbol), name(t.name) {}
-Symbol_Token::Symbol_Token(const std::string &name) : Expression_Token(Symbol), name(name) {}
-
-Line::Line() : label(""), content_type(Content_Type::None), dir(nullptr), instr(nullptr) {}
-
-Line::Line(const Line &l)
-{
-    label = l.label;
-    content_type = l.content_type;
-    dir = l.dir != nullptr ? new Directive(*(l.dir)) : nullptr;
-    instr = l.instr != nullptr ? new Instruction(*(l.instr)) : nullptr;
-}
-
-Line::~Line()
-{
-    freeDir();
-    freeInstr();
-}
-
-Directive& Line::getDir()
-{
-    if (dir == nullptr)
-        dir = new Directive();
-    return *dir;
-}
-
-Instruction& Line::getInstr()
-{
-    if (instr == nullptr)
-        instr = new Instruction();
-    return *instr;
-}
-
-void Line::freeDir()
-{
-    if (dir != nullptr)
-        delete dir;
-    dir = nullptr;
-}
-
-void Line::freeInstr()
+Parser::Parser(const Lexer *lexer)
 {
-    if (instr != nullptr)
-        delete instr;
-    instr = nullptr;
+    this->lexer = lexer;
 }
 
-Parser::Parser(Lexer *lexer)
+const Parser &Parser::shared()
 {
-    this->lexer = lexer;
-
-    // Initializing directive map
-    for (uint8_t i = 0; i < DIR_CNT; ++i)
-        dir_map[dir_str[i]] = i;
-    // Initializing instructions map
-    for (uint8_t i = 0; i < INSTR_CNT; ++i)
-        instr_map[instr_str[i]] = i;
-    // Initializing pseudo-instructions map
-    pseudo_map[pseudo_str[0]] = Instruction::Push; // pushf
-    pseudo_map[pseudo_str[1]] = Instruction::Pop; // popf
+    static const Parser parser(&Lexer::shared());
+    return parser;
 }
 
 string Parser::get_directive(uint8_t code) const
 {
     if (code >= DIR_CNT) return "";
-    return dir_str[code];
+    return dir_kw[code].name;
 }
 
 string Parser::get_instruction(uint8_t code) const
 {
     if (code >= INSTR_CNT) return "";
-    return instr_str[code];
+    return instr_kw[code].name;
 }
 
-bool Parser::parse_line(const string &str, Line &result)
+bool Parser::parse_line(const Token &str, Line &result, string &error) const
 {
-    result.label = "";
+    result.label = Token();
     result.content_type = Content_Type::None;
     if (lexer->is_empty(str)) return true; // empty line
 
@@ -164,33 +190,33 @@ bool Parser::parse_line(const string &str, Line &result)
 
     result.label = tokens[0];
     if (lexer->is_empty(tokens[1])) return true;
-    if (parse_directive(tokens[1], result.getDir()))
+    if (parse_directive(tokens[1], result.dir))
     {
         result.content_type = Content_Type::Directive;
         return true;
     }
-    result.freeDir();
-    if (parse_instruction(tokens[1], result.getInstr()))
+    if (parse_instruction(tokens[1], result.instr, error))
     {
         result.content_type = Content_Type::Instruction;
         return true;
     }
-    result.freeInstr();
     return false; // invalid content
 }
 
-bool Parser::parse_directive(const string &str, Directive &result)
+bool Parser::parse_directive(const Token &str, Directive &result) const
 {
     result.code = -1;
-    result.p1 = "";
-    result.p2 = "";
-    result.p3 = "";
+    result.p1 = Token();
+    result.p2 = Token();
+    result.p3 = Token();
 
     tokens_t tokens;
     if (!lexer->tokenize_directive(str, tokens)) return false;
     if (tokens.size() < 1) return false; // should never happen!
 
-    result.code = dir_map[tokens[0]];
+    uint8_t key = dir_table::find(tokens[0].data(), tokens[0].size());
+    if (key == KEYWORD_NONE) return false; // should never happen!
+    result.code = dir_kw[key / 3].code;
     if (tokens.size() > 1) result.p1 = tokens[1];
     if (tokens.size() > 2) result.p2 = tokens[2];
     if (tokens.size() > 3) result.p3 = tokens[3];
@@ -198,25 +224,56 @@ bool Parser::parse_directive(const string &str, Directive &result)
     return true;
 }
 
-bool Parser::parse_instruction(const string &str, Instruction &result)
+bool Parser::parse_instruction(const Token &str, Instruction &result, string &error) const
 {
     result.code = -1;
     result.op_cnt = 0;
     result.op_size = 0;
-    result.op1 = "";
-    result.op2 = "";
+    result.op1 = Token();
+    result.op2 = Token();
 
     tokens_t tokens;
-    if (!lexer->tokenize_zeroaddr(str, tokens))
-    if (!lexer->tokenize_oneaddr(str, tokens))
-    if (!lexer->tokenize_twoaddr(str, tokens)) return false;
-    if (tokens.size() < 1) return false; // should never happen!
+    if (!lexer->tokenize_instruction(str, tokens)) return false;
 
-    string mnem = Lexer::tolower(tokens[0]);
+    // Mnemonic and operand size suffix (if any) are looked up together
+    const Token &name = tokens[0];
+    uint8_t key = instr_table::find(name.data(), name.size());
+    if (key == KEYWORD_NONE)
+    {
+        error = "Unknown instruction: '" + name.str() + "'";
+        return false;
+    }
+    const Instruction_Grammar &g = instr_grammar[key / 3];
+    if (tokens.size() - 1 != g.op_cnt)
+    {
+        error = "Instruction '" + name.str() + "' takes " + std::to_string(g.op_cnt) + " operand(s)";
+        return false;
+    }
 
-    if (pseudo_map.count(mnem) > 0)
+    // Operands of unsized instructions are validated as bytes (only int takes an immediate)
+    bool word = instr_kw[key / 3].sized && key % 3 != Keyword_Suffix::Byte;
+    uint8_t fits[2] = { 0, 0 }; // combinations each operand fits into
+    for (unsigned i = 0; i < g.op_cnt; ++i)
+    {
+        for (unsigned alt = 0; alt < g.alt_cnt; ++alt)
+            if (lexer->match_operand(tokens[1 + i], g.op[alt][i], word)) fits[i] |= 1 << alt;
+        if (fits[i] == 0)
+        {
+            error = "Invalid operand " + std::to_string(i + 1) + " of instruction '" + name.str() + "': '" + tokens[1 + i].str() + "'";
+            return false;
+        }
+    }
+    if (g.op_cnt == 2 && (fits[0] & fits[1]) == 0)
     {
-        result.code = pseudo_map[mnem];
+        error = "Invalid operand 2 of instruction '" + name.str() + "': '" + tokens[2].str()
+            + "' (cannot be combined with '" + tokens[1].str() + "')";
+        return false;
+    }
+
+    result.code = instr_kw[key / 3].code;
+
+    if (key / 3 >= INSTR_CNT)
+    {   // pseudo-instruction
         switch (result.code)
         {
         case Instruction::Push:
@@ -230,81 +287,132 @@ bool Parser::parse_instruction(const string &str, Instruction &result)
         }
     }
 
-    result.code = instr_map[mnem];
+    if (g.op_cnt == 0) return true; // zero-addr instruction
 
-    if (tokens.size() == 1) return true; // zero-addr instruction (1 token)
-    if (tokens.size() < 3) return false;
+    result.op_size = key % 3 == Keyword_Suffix::Byte ? Operand_Size::Byte : Operand_Size::Word;
+    result.op_cnt = g.op_cnt;
+    result.op1 = tokens[1];
+    if (g.op_cnt == 2) result.op2 = tokens[2];
 
-    string op_size = Lexer::tolower(tokens[1]);
-    if (op_size.empty()) op_size = "w";
-    result.op_size = op_size[0] == 'b' ? Operand_Size::Byte : Operand_Size::Word;
-
-    result.op_cnt++; // could be either one-addr or two-addr instruction
-    result.op1 = tokens[2];
-
-    if (tokens.size() == 3) return true; // one-addr instruction (3 tokens)
-    if (tokens.size() > 4) return false;
+    return true;
+}
 
-    result.op_cnt++;
-    result.op2 = tokens[3];
+// Indexed by Operator_Token::Operator_Type
+static const char operator_symbols[] = "()+-*/%&|^";
 
-    return true; // two-addr instruction (4 tokens)
+// Emits op, folding it into a single number if both operands are numbers.
+// Division by zero is left to the evaluator, which rejects the expression.
+static void emit_operator(Expression &result, Operator_Token op)
+{
+    size_t n = result.code.size();
+    if (n >= 2 && result.code[n - 1].code == Expression_Op::Number && result.code[n - 2].code == Expression_Op::Number
+        && !(op.divides() && result.code[n - 1].value == 0))
+    {
+        result.code[n - 2].value = op.calculate(result.code[n - 2].value, result.code[n - 1].value);
+        result.code.pop_back();
+        return;
+    }
+    Expression_Op instr = { (uint8_t) op.op_type, 0 };
+    result.code.push_back(instr);
 }
 
-bool Parser::parse_expression(const string &str, Expression &result)
+bool Parser::parse_expression(const Token &str, Expression &result, String_Pool &strings) const
 {
-    tokens_t tokens;
-    if (!lexer->tokenize_expression(str, tokens)) return false;
-    for (auto token : tokens)
+    // Shunting-yard: operands are emitted as they come, operators wait on the
+    // stack until an operator of lower or equal priority (or ')') arrives
+    result.code.clear();
+    result.symbols.clear();
+    Operator_Token::Operator_Type ops[EXPR_STACK_MAX];
+    unsigned op_cnt = 0, depth = 0;
+    bool operand = true; // an operand or '(' is expected next
+    Expression_Scanner scanner = lexer->tokenize_expression(str);
+    Token token;
+    while (scanner.next(token))
     {
-        if (token[0] == '(')
-            result.emplace_back(new Operator_Token(Operator_Token::Open));
-        else if (token[0] == ')')
-            result.emplace_back(new Operator_Token(Operator_Token::Close));
-        else if (token[0] == '+')
-            result.emplace_back(new Operator_Token(Operator_Token::Add));
-        else if (token[0] == '-' && token.length() == 1)
-            result.emplace_back(new Operator_Token(Operator_Token::Sub));
-        else if (token[0] == '*')
-            result.emplace_back(new Operator_Token(Operator_Token::Mul));
-        else if (token[0] == '/')
-            result.emplace_back(new Operator_Token(Operator_Token::Div));
-        else if (token[0] == '%')
-            result.emplace_back(new Operator_Token(Operator_Token::Mod));
-        else if (token[0] == '&')
-            result.emplace_back(new Operator_Token(Operator_Token::And));
-        else if (token[0] == '|')
-            result.emplace_back(new Operator_Token(Operator_Token::Or));
-        else if (token[0] == '^')
-            result.emplace_back(new Operator_Token(Operator_Token::Xor));
-        else if (token[0] == '-' || token[0] == '~' || token[0] >= '0' && token[0] <= '9')
-            result.emplace_back(new Number_Token(decode_number(token)));
+        const char *sym = token.length() == 1 ? strchr(operator_symbols, token[0]) : nullptr;
+        if (sym == nullptr)
+        {   // number or symbol
+            if (!operand || ++depth > EXPR_STACK_MAX) return false;
+            Expression_Op instr = { Expression_Op::Number, 0 };
+            if (token[0] == '-' || token[0] == '~' || (token[0] >= '0' && token[0] <= '9'))
+                instr.value = decode_number(token);
+            else
+            {
+                instr.code = Expression_Op::Symbol;
+                instr.value = result.symbols.size();
+                result.symbols.push_back(strings.intern(token));
+            }
+            result.code.push_back(instr);
+            operand = false;
+            continue;
+        }
+        Operator_Token op((Operator_Token::Operator_Type) (sym - operator_symbols));
+        if (op.op_type == Operator_Token::Open)
+        {
+            if (!operand || op_cnt == EXPR_STACK_MAX) return false;
+            ops[op_cnt++] = op.op_type;
+        }
+        else if (op.op_type == Operator_Token::Close)
+        {
+            if (operand) return false;
+            while (op_cnt > 0 && ops[op_cnt - 1] != Operator_Token::Open)
+            {
+                emit_operator(result, ops[--op_cnt]);
+                depth--;
+            }
+            if (op_cnt == 0) return false; // unbalanced ')'
+            op_cnt--; // pop '('
+        }
         else
-            result.emplace_back(new Symbol_Token(token));
+        {
+            if (operand) return false;
+            while (op_cnt > 0 && Operator_Token(ops[op_cnt - 1]).priority() >= op.priority())
+            {
+                emit_operator(result, ops[--op_cnt]);
+                depth--;
+            }
+            if (op_cnt == EXPR_STACK_MAX) return false;
+            ops[op_cnt++] = op.op_type;
+            operand = true;
+        }
+    }
+    if (!scanner.valid() || operand) return false;
+    while (op_cnt > 0)
+    {
+        if (ops[op_cnt - 1] == Operator_Token::Open) return false; // unbalanced '('
+        emit_operator(result, ops[--op_cnt]);
     }
     return true;
 }
 
-int Parser::decode_number(const string &str)
+int Parser::decode_number(const Token &str) const
 {
+    // str is a value accepted by the lexer: [-~]?(0[bB]bin|0oct|0[xX]hex|0|dec)
     int result = 0;
     bool inv = str[0] == '~', neg = str[0] == '-';
-    unsigned first = inv || neg;
-    if (str[first] != '0') result = stoul(str.substr(first), 0, 10);
-    else if (str.length() == first + 1) result = 0; // 0 || ~0 || -0
-    else if (str[first + 1] == 'b') result = stoul(str.substr(first + 2), 0, 2);
-    else if (str[first + 1] != 'x') result = stoul(str.substr(first + 1), 0, 8);
-    else result = stoul(str.substr(first + 2), 0, 16);
+    unsigned i = inv || neg, base = 10;
+    if (str[i] == '0' && i + 1 < str.length())
+    {
+        if (str[i + 1] == 'b' || str[i + 1] == 'B') base = 2, i += 2;
+        else if (str[i + 1] == 'x' || str[i + 1] == 'X') base = 16, i += 2;
+        else base = 8, i += 1;
+    }
+    for (; i < str.length(); ++i)
+    {
+        char c = str[i];
+        unsigned digit = c >= '0' && c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        result = result * base + digit;
+    }
     if (inv) result = ~result;
     else if (neg) result = -result;
     return result;
 }
 
-bool Parser::decode_byte(const string &str, uint8_t &byte)
+bool Parser::decode_byte(const Token &str, uint8_t &byte) const
 {
     byte = 0;
-    if (str == "") return true;
-    string value;
+    if (str.empty()) return true;
+    Token value;
     if (!lexer->match_byte(str, value)) return false;
     bool inv = str[0] == '~', neg = str[0] == '-';
     int temp = decode_number(inv || neg ? value.substr(1) : value);
@@ -318,11 +426,11 @@ bool Parser::decode_byte(const string &str, uint8_t &byte)
     return false;
 }
 
-bool Parser::decode_word(const string &str, uint16_t &word)
+bool Parser::decode_word(const Token &str, uint16_t &word) const
 {
     word = 0;
-    if (str == "") return true;
-    string value;
+    if (str.empty()) return true;
+    Token value;
     if (!lexer->match_word(str, value)) return false;
     bool inv = str[0] == '~', neg = str[0] == '-';
     int temp = decode_number(inv || neg ? value.substr(1) : value);
@@ -336,7 +444,7 @@ bool Parser::decode_word(const string &str, uint16_t &word)
     return false;
 }
 
-bool Parser::decode_register(const string &str, uint8_t &regdesc)
+bool Parser::decode_register(const Token &str, uint8_t &regdesc) const
 {
     regdesc = 0;
     if (str[0] == 'r') regdesc |= (str[1] - '0') << 1;
@@ -0,0 +1,101 @@
+#include "section.h"
+
+#include <algorithm>
+#include <string.h>
+
+Shdrtab_Entry::Shdrtab_Entry() {};
+
+Shdrtab_Entry::Shdrtab_Entry(Elf16_Addr index, Elf16_Word type, Elf16_Word flags, Elf16_Word info, Elf16_Word entsize, Elf16_Word size)
+    : index(index)
+{
+    shdr.sh_name        = index;    // Section header string table index
+    shdr.sh_type        = type;     // Section type
+    shdr.sh_flags       = flags;    // Section flags
+    shdr.sh_addr        = 0;        // Section virtual address
+    shdr.sh_offset      = 0;        // Section file offset
+    shdr.sh_size        = size;     // Section size in bytes
+    shdr.sh_link        = 0;        // Link to another section
+    shdr.sh_info        = info;     // Additional section information
+    shdr.sh_addralign   = 0;        // Section alignment (0 | 1 = no alignment, 2^n = alignment)
+    shdr.sh_entsize     = entsize;  // Entry size if section holds table
+}
+
+Reltab_Entry::Reltab_Entry(Elf16_Word info, Elf16_Addr offset)
+{
+    rel.r_offset = offset;
+    rel.r_info = info;
+}
+
+void Section_Buffer::fill(Elf16_Half byte, size_t count)
+{
+    if (count == 0) return;
+    if (!fills.empty() && fills.back().byte == byte && fills.back().offset + fills.back().size == size())
+        fills.back().size += count; // extends the previous fill
+    else
+    {
+        Fill_Span span = { (uint32_t) size(), (uint32_t) count, byte };
+        fills.push_back(span);
+    }
+    filled += count;
+}
+
+void Section_Buffer::copy_stored(size_t from, size_t count, Elf16_Half *dst) const
+{
+    while (count > 0)
+    {
+        size_t at = from & (SECTION_CHUNK - 1), len = std::min<size_t>(count, SECTION_CHUNK - at);
+        memcpy(dst, chunks[from >> SECTION_CHUNK_BITS].get() + at, len);
+        dst += len;
+        from += len;
+        count -= len;
+    }
+}
+
+void Section_Buffer::copy_to(Elf16_Half *dst) const
+{
+    size_t from = 0, offset = 0;
+    for (const Fill_Span &span : fills)
+    {
+        copy_stored(from, span.offset - offset, dst + offset);
+        from += span.offset - offset;
+        memset(dst + span.offset, span.byte, span.size);
+        offset = span.offset + span.size;
+    }
+    copy_stored(from, stored() - from, dst + offset);
+}
+
+void Section_Buffer::append(const Section_Buffer &other)
+{
+    size_t from = 0, offset = 0;
+    for (const Fill_Span &span : other.fills)
+    {
+        append_stored(other, from, span.offset - offset);
+        from += span.offset - offset;
+        fill(span.byte, span.size);
+        offset = span.offset + span.size;
+    }
+    append_stored(other, from, other.stored() - from);
+}
+
+void Section_Buffer::append_stored(const Section_Buffer &other, size_t from, size_t count)
+{
+    while (count > 0)
+    {
+        if (pos == end) grow();
+        size_t len = std::min<size_t>(count, end - pos);
+        other.copy_stored(from, len, pos);
+        pos += len;
+        from += len;
+        count -= len;
+    }
+}
+
+void Section_Buffer::grow()
+{
+    chunks.emplace_back(new Elf16_Half[SECTION_CHUNK]);
+    pos = chunks.back().get();
+    end = pos + SECTION_CHUNK;
+}
+
+Section::Section(str_id_t name, const Shdrtab_Entry &header)
+    : name(name), header(header), loc_cnt(0), symbol(0), rel(0) {}
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include "source_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::ostream;
+using std::string;
+
+bool Source_File::open(const string &name, ostream &errors)
+{
+    close();
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        errors << "ERROR: Input file: '" << name << "' cannot be opened for reading!\n";
+        return false;
+    }
+    struct stat st;
+    bool ok;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        if ((uint64_t) st.st_size >= UINT32_MAX)
+        {
+            errors << "ERROR: Input file: '" << name << "' is too large!\n";
+            ::close(fd);
+            return false;
+        }
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED)
+        {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            map = (const char *) addr;
+            len = st.st_size;
+            ok = true;
+        }
+        else ok = read_all(fd, name, errors); // e.g. file systems without mmap support
+    }
+    else ok = read_all(fd, name, errors);
+    ::close(fd);
+    return ok;
+}
+
+void Source_File::close()
+{
+    if (map != nullptr) munmap((void *) map, len);
+    map = nullptr;
+    len = 0;
+    buffer.clear();
+}
+
+bool Source_File::read_all(int fd, const string &name, ostream &errors)
+{
+    char chunk[65536];
+    for (;;)
+    {
+        ssize_t cnt = read(fd, chunk, sizeof(chunk));
+        if (cnt == 0) break;
+        if (cnt < 0)
+        {
+            if (errno == EINTR) continue;
+            errors << "ERROR: Input file: '" << name << "' cannot be read!\n";
+            return false;
+        }
+        buffer.append(chunk, cnt);
+        if (buffer.size() >= UINT32_MAX)
+        {
+            errors << "ERROR: Input file: '" << name << "' is too large!\n";
+            return false;
+        }
+    }
+    len = buffer.size();
+    return true;
+}
\ No newline at end of file
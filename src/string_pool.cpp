@@ -0,0 +1,45 @@
+#include "string_pool.h"
+
+String_Pool::String_Pool() : strings(1), hashes(1, 0), slots(64, 0) {}
+
+uint32_t String_Pool::hash(const Token &str)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < str.size(); ++i)
+        h = (h ^ (unsigned char) str[i]) * 16777619u;
+    return h;
+}
+
+str_id_t String_Pool::intern(const Token &str)
+{
+    if (str.empty()) return 0;
+    uint32_t h = hash(str);
+    size_t mask = slots.size() - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask)
+    {
+        str_id_t id = slots[i];
+        if (id == 0)
+        {   // not found, add it to the pool
+            id = strings.size();
+            strings.emplace_back(str.data(), str.size());
+            hashes.push_back(h);
+            slots[i] = id;
+            if (2 * strings.size() > slots.size()) grow();
+            return id;
+        }
+        if (hashes[id] == h && Token(strings[id]) == str) return id;
+    }
+}
+
+void String_Pool::grow()
+{
+    std::vector<str_id_t> bigger(2 * slots.size(), 0);
+    slots.swap(bigger);
+    size_t mask = slots.size() - 1;
+    for (str_id_t id = 1; id < strings.size(); ++id)
+    {
+        size_t i = hashes[id] & mask;
+        while (slots[i] != 0) i = (i + 1) & mask;
+        slots[i] = id;
+    }
+}
\ No newline at end of file
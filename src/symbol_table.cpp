@@ -0,0 +1,59 @@
+#include "symbol_table.h"
+
+#define SLOT_EMPTY UINT32_MAX
+
+Symtab_Entry::Symtab_Entry() {};
+
+Symtab_Entry::Symtab_Entry(Elf16_Word name, Elf16_Addr value, uint8_t info, Elf16_Section shndx, bool is_equ)
+    : index(0), is_equ(is_equ), expansion(0)
+{
+    sym.st_name     = name;     // String table index
+    sym.st_value    = value;    // Symbol value
+    sym.st_size     = 0;        // Symbol size
+    sym.st_info     = info;     // Symbol type and binding
+    sym.st_other    = 0;        // No defined meaning, 0
+    sym.st_shndx    = shndx;    // Section header table index
+}
+
+Symbol_Table::Symbol_Table() : bits(6)
+{
+    Slot empty = { 0, SLOT_EMPTY };
+    slots.assign(1u << bits, empty);
+}
+
+Symtab_Entry *Symbol_Table::find(str_id_t name)
+{
+    size_t mask = slots.size() - 1;
+    for (size_t i = slot(name); ; i = (i + 1) & mask)
+    {
+        if (slots[i].handle == SLOT_EMPTY) return nullptr;
+        if (slots[i].name == name) return &entries[slots[i].handle];
+    }
+}
+
+Symtab_Entry &Symbol_Table::insert(str_id_t name, const Symtab_Entry &entry)
+{
+    size_t mask = slots.size() - 1, i = slot(name);
+    while (slots[i].handle != SLOT_EMPTY) i = (i + 1) & mask;
+    slots[i].name = name;
+    slots[i].handle = entries.size();
+    entries.push_back(entry);
+    entries.back().index = slots[i].handle;
+    names.push_back(name);
+    if (2 * entries.size() > slots.size()) grow();
+    return entries.back();
+}
+
+void Symbol_Table::grow()
+{
+    Slot empty = { 0, SLOT_EMPTY };
+    slots.assign(1u << ++bits, empty);
+    size_t mask = slots.size() - 1;
+    for (sym_handle_t handle = 0; handle < names.size(); ++handle)
+    {
+        size_t i = slot(names[handle]);
+        while (slots[i].handle != SLOT_EMPTY) i = (i + 1) & mask;
+        slots[i].name = names[handle];
+        slots[i].handle = handle;
+    }
+}
\ No newline at end of file
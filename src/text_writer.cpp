@@ -0,0 +1,144 @@
+#include "text_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <unistd.h>
+
+using std::ostream;
+using std::string;
+
+#define HEX_ROW_BYTES   16
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Two hex digits for every byte value
+static const struct Hex_Pairs
+{
+    char digits[256][2];
+    Hex_Pairs()
+    {
+        for (unsigned i = 0; i < 256; ++i)
+        {
+            digits[i][0] = hex_digits[i >> 4];
+            digits[i][1] = hex_digits[i & 0xf];
+        }
+    }
+} hex_pairs;
+
+bool Text_Writer::open(const string &name, ostream &errors)
+{
+    close();
+    fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        errors << "ERROR: File: '" << name << "' cannot be opened for writing!\n";
+        return false;
+    }
+    failed = false;
+    return true;
+}
+
+bool Text_Writer::close()
+{
+    if (fd < 0) return !failed;
+    flush();
+    if (::close(fd) != 0) failed = true;
+    fd = -1;
+    return !failed;
+}
+
+void Text_Writer::put(const char *str, size_t size)
+{
+    while (size > 0)
+    {
+        if (len == TEXT_WRITER_BUFFER) flush();
+        size_t cnt = TEXT_WRITER_BUFFER - len < size ? TEXT_WRITER_BUFFER - len : size;
+        memcpy(buf + len, str, cnt);
+        len += cnt;
+        str += cnt;
+        size -= cnt;
+    }
+}
+
+void Text_Writer::put_hex(unsigned value, unsigned digits)
+{
+    char tmp[8];
+    unsigned cnt = 0;
+    do
+    {
+        tmp[cnt++] = hex_digits[value & 0xf];
+        value >>= 4;
+    } while (value != 0);
+    for (; digits > cnt; --digits) put('0');
+    while (cnt > 0) put(tmp[--cnt]);
+}
+
+void Text_Writer::put_hex_bytes(const uint8_t *bytes, size_t count)
+{
+    char row[3 * HEX_ROW_BYTES];
+    while (count > 0)
+    {
+        size_t cnt = count < HEX_ROW_BYTES ? count : HEX_ROW_BYTES;
+        char *dst = row;
+        for (size_t i = 0; i < cnt; ++i, dst += 3)
+        {
+            memcpy(dst, hex_pairs.digits[bytes[i]], 2);
+            dst[2] = ' ';
+        }
+        bytes += cnt;
+        count -= cnt;
+        put(row, dst - row - (count == 0 ? 1 : 0)); // no separator after the last byte
+    }
+}
+
+void Text_Writer::put_dec(unsigned value, unsigned width)
+{
+    char tmp[10];
+    unsigned cnt = 0;
+    do
+    {
+        tmp[cnt++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    if (width > cnt) pad(width - cnt);
+    while (cnt > 0) put(tmp[--cnt]);
+}
+
+void Text_Writer::put_dec_left(unsigned value, unsigned width)
+{
+    unsigned digits = 1;
+    for (unsigned rest = value / 10; rest != 0; rest /= 10) ++digits;
+    put_dec(value);
+    if (width > digits) pad(width - digits);
+}
+
+void Text_Writer::put_left(const char *str, size_t size, size_t width)
+{
+    put(str, size);
+    if (width > size) pad(width - size);
+}
+
+void Text_Writer::pad(size_t count)
+{
+    while (count-- > 0) put(' ');
+}
+
+void Text_Writer::flush()
+{
+    const char *data = buf;
+    while (len > 0 && fd >= 0 && !failed)
+    {
+        ssize_t cnt = write(fd, data, len);
+        if (cnt < 0)
+        {
+            if (errno == EINTR) continue;
+            failed = true;
+            break;
+        }
+        data += cnt;
+        len -= cnt;
+    }
+    len = 0;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Times .equ resolution on generated sources of <count> .equ symbols:
+#   chain   - every symbol uses the next one, defined later in the file
+#   tree    - every symbol uses its two children, defined later in the file
+#   fanout  - every symbol uses one symbol defined at the end of the file
+# Every symbol is left unevaluated by the first pass and resolved afterwards.
+# Above 65534 symbols the object cannot be written (the symbol table is full),
+# but only after every .equ is resolved, so the timing still covers all of it.
+# usage: tests/bench_equ.sh [assembler] [count] [runs]
+
+cd "$(dirname "$0")/.." || exit 1
+ASSEMBLER=$(realpath "${1:-out/assembler}")
+COUNT=${2:-100000}
+RUNS=${3:-5}
+[ -x "$ASSEMBLER" ] || { echo "ERROR: Assembler not found: $ASSEMBLER"; exit 2; }
+
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+
+awk -v n=$COUNT 'BEGIN { for (i = 0; i < n; i++) printf ".equ e%d, e%d + 1\n", i, i + 1; printf ".equ e%d, 1\n.end\n", n }' > "$TMP/chain.s"
+awk -v n=$COUNT 'BEGIN {
+    for (i = 0; i < n; i++)
+        if (2 * i + 2 < n) printf ".equ e%d, e%d + e%d\n", i, 2 * i + 1, 2 * i + 2
+        else printf ".equ e%d, last + %d\n", i, i
+    printf ".equ last, 3\n.end\n" }' > "$TMP/tree.s"
+awk -v n=$COUNT 'BEGIN { for (i = 0; i < n; i++) printf ".equ e%d, last * 2 + %d\n", i, i; printf ".equ last, 7\n.end\n" }' > "$TMP/fanout.s"
+
+# Median wall time of RUNS runs in milliseconds
+time_ms()
+{
+    for run in $(seq 1 "$RUNS"); do
+        start=$(date +%s%N)
+        "$ASSEMBLER" -q "$@" > /dev/null 2>&1
+        end=$(date +%s%N)
+        echo $(((end - start) / 1000000))
+    done | sort -n | sed -n "$(((RUNS + 1) / 2))p"
+}
+
+echo "$COUNT .equ symbols, median of $RUNS runs:"
+for shape in chain tree fanout; do
+    printf "  %-8s %6d ms\n" $shape "$(time_ms "$TMP/$shape.s" -o "$TMP/$shape.o")"
+done
\ No newline at end of file
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Times -j 1 to 32 on a mixed-size corpus: <copies> copies of tests/*.s and of
+# generated sources of 10, 100, 1000 and 3000 blocks (about 100 to 30000 lines),
+# all assembled in one run. Prints the median wall time and the speedup over -j 1.
+# usage: tests/bench_jobs.sh [assembler] [copies] [runs]
+
+cd "$(dirname "$0")/.." || exit 1
+ASSEMBLER=$(realpath "${1:-out/assembler}")
+COPIES=${2:-4}
+RUNS=${3:-3}
+[ -x "$ASSEMBLER" ] || { echo "ERROR: Assembler not found: $ASSEMBLER"; exit 2; }
+
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+
+mkdir "$TMP/gen"
+for blocks in 10 100 1000 3000; do tests/gen_source.sh $blocks > "$TMP/gen/gen$blocks.s"; done
+for src in tests/*.s "$TMP"/gen/*.s; do
+    name=$(basename "$src" .s)
+    for n in $(seq 1 "$COPIES"); do cp "$src" "$TMP/${name}_$n.s"; done
+done
+files=$(ls "$TMP"/*.s | wc -l)
+lines=$(cat "$TMP"/*.s | wc -l)
+
+# Median wall time of RUNS runs in milliseconds
+time_ms()
+{
+    for run in $(seq 1 "$RUNS"); do
+        start=$(date +%s%N)
+        (cd "$TMP" && "$ASSEMBLER" -q -j $1 *.s > /dev/null 2>&1)
+        end=$(date +%s%N)
+        echo $(((end - start) / 1000000))
+    done | sort -n | sed -n "$(((RUNS + 1) / 2))p"
+}
+
+echo "$files files, $lines lines, $(nproc) CPUs, median of $RUNS runs:"
+base=0
+for j in 1 2 4 8 16 32; do
+    ms=$(time_ms $j)
+    [ $j = 1 ] && base=$ms
+    printf "  -j %-3d %6d ms  %5s x\n" $j $ms "$(awk -v a=$base -v b=$ms 'BEGIN { printf "%.2f", (b > 0 ? a / b : 0) }')"
+done
\ No newline at end of file
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Assembles tests/*.s and compares the objects and the -v logs with the ones in
+# tests/golden. Single-pass (-s) objects must match the same golden objects.
+# usage: tests/check_golden.sh [assembler] [--update]
+
+cd "$(dirname "$0")/.." || exit 1
+ASSEMBLER=out/assembler
+UPDATE=0
+for arg in "$@"; do
+    if [ "$arg" = "--update" ]; then UPDATE=1; else ASSEMBLER=$arg; fi
+done
+[ -x "$ASSEMBLER" ] || { echo "ERROR: Assembler not found: $ASSEMBLER"; exit 2; }
+
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+
+failed=0
+for src in tests/*.s; do
+    name=$(basename "$src" .s)
+    "$ASSEMBLER" -v "$src" -o "$TMP/$name.o" > "$TMP/$name.log" 2>&1
+    echo "exit: $?" >> "$TMP/$name.log"
+    if [ $UPDATE = 1 ]; then
+        cp "$TMP/$name.o" "$TMP/$name.log" tests/golden/
+        continue
+    fi
+    for file in "$name.o" "$name.log"; do
+        if ! cmp -s "tests/golden/$file" "$TMP/$file"; then
+            echo "FAILED: $src ($file differs)"
+            diff "tests/golden/$file" "$TMP/$file" | head -20
+            failed=1
+        fi
+    done
+    "$ASSEMBLER" -q -s "$src" -o "$TMP/$name.s.o" > /dev/null 2>&1
+    if ! cmp -s "tests/golden/$name.o" "$TMP/$name.s.o"; then
+        echo "FAILED: $src (-s object differs)"
+        failed=1
+    fi
+done
+
+[ $UPDATE = 1 ] && { echo "Golden files updated"; exit 0; }
+[ $failed = 0 ] && echo "Golden outputs: all tests passed"
+exit $failed
\ No newline at end of file
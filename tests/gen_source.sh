@@ -0,0 +1,24 @@
+#!/bin/bash
+# Writes a source of <blocks> blocks of 10 lines to stdout. Every block has
+# every line kind and refers to the previous one. Sections stay below 64 KiB
+# up to about 4000 blocks.
+# usage: tests/gen_source.sh <blocks>
+
+echo ".global main"
+echo ".extern printf"
+echo ".equ step, 2"
+for i in $(seq 0 $(($1 - 1))); do
+    echo ".text"
+    echo "L$i: mov r0, &D$i"
+    echo "    add r1, r2[step]"
+    [ $i -gt 0 ] && echo "    jeq \$L$((i - 1))" || echo "    call printf"
+    echo ".data"
+    echo "D$i: .word $i, L$i + 4, printf"
+    echo "    .byte $((i % 256)), step * 3"
+    echo "    .align 4"
+    echo ".bss"
+    echo "    .skip $((i % 7 + 1))"
+done
+echo ".text"
+echo "main: ret"
+echo ".end"
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "lexer.h"
+
+#include <iostream>
+#include <new>
+#include <stdlib.h>
+
+using std::cout;
+using std::endl;
+
+// Runs every lexer entry point over a set of representative lines and checks
+// that none of them allocates: tokens are views into the line, token arrays
+// have a fixed capacity and comma lists and expressions are scanned in place.
+
+static size_t allocations = 0;
+
+void *operator new(size_t size)
+{
+    ++allocations;
+    void *ptr = malloc(size != 0 ? size : 1);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+static const char *lines[] = {
+    "",
+    "   \t  ",
+    "# comment only",
+    "\t; comment only\r",
+    ".data",
+    "test: .skip 100, 0xff",
+    ".align 8, 03, 6",
+    "test2: .skip 0x43, 057",
+    ".byte   ~0b00100010, \t\t  074, \t -135, \t\t0xf2",
+    ".word \t\t-0b0101010101010101,  \t~0356,   \t6421, \t0x3f2a",
+    ".equ num, 45",
+    ".equ expr, (num + 3) * 2 - label % 7 & 0xff | ~1 ^ 2 / 1",
+    ".set num, num + 1 # redefined",
+    ".text",
+    ".global MaIn, other",
+    ".extern printf, test, \t\ts2areage._est  # comment parsing",
+    "   MaIn:    # \t\ttest comment",
+    "test3: mov\tr0, &num\t# 1 + 1 + 3 = 5B",
+    "\tadd r5, [r2]",
+    "\ttest r2[0x5], r0",
+    "\tand r4[536], r0",
+    "\tsubb r2l, r3h",
+    "\txchgw r0, sp",
+    "\tmov r1, r2[label]",
+    "\tcall $function",
+    "\tjmp *0x1000",
+    "\tpushf",
+    "\tint 3",
+    "\thalt",
+    ".section\t  \t.rodata\t , \t\t\"a\"",
+    ".section .bss2, \"ew\"",
+    ".L0: # gcc style labels",
+    "_testLab_el12.3test: #mov r0, r1#test",
+    "023test: mov r0, r1",
+    "\tmov r0, r1, r2",
+    "\tmovb r9, 0x1ff",
+    ".word 65536, 0x1ffff",
+    ".byte 1,,2",
+    ".end"
+};
+
+static void lex_operand(const Lexer &lexer, const Token &op)
+{
+    Token a, b;
+    lexer.match_symbol(op, a);
+    lexer.match_byte(op, a);
+    lexer.match_word(op, a);
+    lexer.match_imm_b(op, a);
+    lexer.match_imm_w(op, a);
+    lexer.match_regdir_b(op, a);
+    lexer.match_regdir_w(op, a);
+    lexer.match_regind(op, a);
+    lexer.match_regindoff(op, a, b);
+    lexer.match_regindsym(op, a, b);
+    lexer.match_memsym(op, a);
+    lexer.match_memabs(op, a);
+    for (uint8_t modes = ADR_IMM; modes <= (ADR_IMM | ADR_REGDIR | ADR_MEM); ++modes)
+    {
+        lexer.match_operand(op, modes, false);
+        lexer.match_operand(op, modes, true);
+    }
+    Expression_Scanner scanner = lexer.tokenize_expression(op);
+    while (scanner.next(a));
+}
+
+static void lex_line(const Lexer &lexer, const Token &line)
+{
+    tokens_t tokens;
+    if (lexer.is_empty(line) || !lexer.tokenize_line(line, tokens)) return;
+    Token content = tokens[1];
+    tokens_t parts;
+    if (lexer.tokenize_directive(content, parts))
+    {
+        for (size_t i = 1; i < parts.size(); ++i)
+        {
+            lexer.split_string(parts[i]).size();
+            for (const Token &op : lexer.split_string(parts[i])) lex_operand(lexer, op);
+        }
+    }
+    else if (lexer.tokenize_instruction(content, parts))
+    {
+        for (size_t i = 1; i < parts.size(); ++i) lex_operand(lexer, parts[i]);
+    }
+}
+
+int main()
+{
+    const Lexer &lexer = Lexer::shared();
+    bool ok = true;
+    for (const char *line : lines)
+    {
+        Token str(line);
+        size_t before = allocations;
+        lex_line(lexer, str);
+        size_t count = allocations - before;
+        if (count != 0)
+        {
+            cout << "FAILED: " << count << " allocation(s) while lexing \"" << line << "\"" << endl;
+            ok = false;
+        }
+    }
+    if (ok) cout << "Lexer: no allocations on " << sizeof(lines) / sizeof(lines[0]) << " lines" << endl;
+    return ok ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "line_index.h"
+
+#include <iostream>
+#include <string>
+
+using std::cout;
+using std::endl;
+using std::string;
+
+// Compares the SSE2 and AVX2 line scans against the scalar one. The inputs put
+// newlines, comment characters, CRs and whitespace on both sides of every 16- and
+// 32-byte block boundary, with and without a trailing newline.
+
+static const char *scan_name[] = { "auto", "scalar", "SSE2", "AVX2" };
+
+static uint32_t rng_state = 12345;
+
+static uint32_t rng()
+{
+    rng_state = rng_state * 1103515245u + 12345u;
+    return rng_state >> 16;
+}
+
+static bool same(const line_index_t &a, const line_index_t &b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i)
+        if (a[i].begin != b[i].begin || a[i].end != b[i].end
+            || a[i].content != b[i].content || a[i].comment != b[i].comment) return false;
+    return true;
+}
+
+static bool check(const string &input, int max_scan)
+{
+    line_index_t expected, actual;
+    index_lines(input.data(), input.size(), expected, Line_Scan::Scalar);
+    for (int scan = Line_Scan::SSE2; scan <= max_scan; ++scan)
+    {
+        index_lines(input.data(), input.size(), actual, scan);
+        if (!same(expected, actual))
+        {
+            cout << "FAILED: " << scan_name[scan] << " scan differs from scalar on input of "
+                 << input.size() << " bytes: \"";
+            for (char c : input)
+            {
+                if (c == '\n') cout << "\\n";
+                else if (c == '\r') cout << "\\r";
+                else if (c == '\t') cout << "\\t";
+                else cout << c;
+            }
+            cout << "\"" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    int max_scan = line_scan_supported();
+    if (max_scan < Line_Scan::SSE2)
+    {
+        cout << "Line index: no vector scan on this CPU, skipped" << endl;
+        return 0;
+    }
+
+    static const char alphabet[] = { ' ', '\t', '\r', '\n', '\v', '\f', '@', '#', ';', 'a', 'r', '0', ',', '\0' };
+    static const char *pieces[] = { "\n", "\r\n", "  ", "\t", "@ c", "# c\r", "; c", "\r", "mov r1, r2", ".word 1", "x:" };
+    const unsigned alphabet_cnt = sizeof(alphabet), piece_cnt = sizeof(pieces) / sizeof(pieces[0]);
+    bool ok = true;
+
+    // Single special character at every offset of two AVX2 blocks, with and without a trailing newline
+    for (unsigned len = 0; len <= 70 && ok; ++len)
+        for (unsigned pos = 0; pos < len && ok; ++pos)
+            for (unsigned k = 0; k < alphabet_cnt && ok; ++k)
+            {
+                string line(len, 'a');
+                line[pos] = alphabet[k];
+                ok = check(line, max_scan) && check(line + "\n", max_scan) && check(line + "\r\n", max_scan);
+            }
+
+    // Lines of every length up to 70 separated by LF or CRLF, so line ends fall on every block offset
+    for (unsigned len = 0; len <= 70 && ok; ++len)
+    {
+        string lf, crlf;
+        for (unsigned n = 0; n < 8; ++n)
+        {
+            string line = string(n % 3, ' ') + string(len, 'x') + (n % 2 ? " @ comment" : "");
+            lf += line + "\n";
+            crlf += line + "\r\n";
+        }
+        ok = check(lf, max_scan) && check(crlf, max_scan)
+            && check(lf.substr(0, lf.size() - 1), max_scan) && check(crlf.substr(0, crlf.size() - 2), max_scan);
+    }
+
+    // Random sources built from characters and source fragments
+    for (unsigned n = 0; n < 20000 && ok; ++n)
+    {
+        string input;
+        unsigned len = rng() % 200;
+        while (input.size() < len)
+        {
+            if (rng() % 2) input += alphabet[rng() % alphabet_cnt];
+            else input += pieces[rng() % piece_cnt];
+        }
+        ok = check(input, max_scan);
+    }
+
+    if (ok) cout << "Line index: " << scan_name[max_scan] << " scan matches scalar" << (max_scan == Line_Scan::AVX2 ? " (SSE2 too)" : "") << endl;
+    return ok ? 0 : 1;
+}
\ No newline at end of file
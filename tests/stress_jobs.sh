@@ -0,0 +1,66 @@
+#!/bin/bash
+# Assembles tests/*.s with -j 16 and compares the objects and the output with
+# -j 1: many copies of every test at once, then every test (and a generated
+# source spanning several parse/encode chunks) on its own with 16 threads, and
+# a batch that stops at an output file that cannot be written.
+# usage: tests/stress_jobs.sh [assembler] [copies]
+
+cd "$(dirname "$0")/.." || exit 1
+ASSEMBLER=$(realpath "${1:-out/assembler}")
+COPIES=${2:-8}
+[ -x "$ASSEMBLER" ] || { echo "ERROR: Assembler not found: $ASSEMBLER"; exit 2; }
+
+TMP=$(mktemp -d) || exit 2
+trap 'rm -rf "$TMP"' EXIT
+mkdir "$TMP/j1" "$TMP/j16"
+
+tests/gen_source.sh 1500 > "$TMP/large.s"
+
+for dir in j1 j16; do
+    for src in tests/*.s "$TMP/large.s"; do
+        name=$(basename "$src" .s)
+        for n in $(seq 1 "$COPIES"); do cp "$src" "$TMP/$dir/${name}_$n.s"; done
+    done
+done
+
+failed=0
+compare()
+{
+    if ! cmp -s "$1" "$2"; then
+        echo "FAILED: $3 differs between -j 1 and -j 16"
+        diff "$1" "$2" | head -20
+        failed=1
+    fi
+}
+
+# Many files at once
+(cd "$TMP/j1" && "$ASSEMBLER" -v -j 1 *.s > ../j1.log 2>&1; echo "exit: $?" >> ../j1.log)
+(cd "$TMP/j16" && "$ASSEMBLER" -v -j 16 *.s > ../j16.log 2>&1; echo "exit: $?" >> ../j16.log)
+compare "$TMP/j1.log" "$TMP/j16.log" "output of $(ls "$TMP/j1" | grep -c '\.s$') files"
+for obj in "$TMP"/j1/*.o; do
+    compare "$obj" "$TMP/j16/$(basename "$obj")" "$(basename "$obj")"
+done
+
+# Every file on its own, parsed and encoded on 16 threads
+for src in "$TMP"/j1/*_1.s; do
+    name=$(basename "$src" .s)
+    for j in 1 16; do
+        (cd "$TMP/j1" && "$ASSEMBLER" -v -j $j "$name.s" -o "$name.$j.o" > "$name.$j.log" 2>&1; echo "exit: $?" >> "$name.$j.log")
+    done
+    compare "$TMP/j1/$name.1.log" "$TMP/j1/$name.16.log" "output of $name.s"
+    compare "$TMP/j1/$name.1.o" "$TMP/j1/$name.16.o" "$name.o"
+done
+
+# A batch stops at the first output file that cannot be written, later files are not assembled
+for j in 1 16; do
+    mkdir "$TMP/fail$j"
+    cp "$TMP"/j1/*_1.s "$TMP/fail$j"/
+    bad=$(ls "$TMP/fail$j"/*.s | sed -n 3p)
+    mkdir "${bad%.s}.o"
+    (cd "$TMP/fail$j" && "$ASSEMBLER" -j $j *.s > ../fail$j.log 2>&1; echo "exit: $?" >> ../fail$j.log)
+done
+compare "$TMP/fail1.log" "$TMP/fail16.log" "output of a failing batch"
+compare <(ls "$TMP/fail1") <(ls "$TMP/fail16") "files written by a failing batch"
+
+[ $failed = 0 ] && echo "Parallel jobs: -j 16 matches -j 1"
+exit $failed
\ No newline at end of file
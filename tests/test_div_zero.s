@@ -0,0 +1,4 @@
+# Division by zero is rejected instead of crashing the assembler
+.data
+.word 5 % 0
+.end
@@ -0,0 +1,7 @@
+# Circular .equ definitions are reported with every symbol of the group
+.equ a, b + c
+.equ b, a
+.equ c, a
+.equ s, s + 1
+.equ ok, 5
+.end
@@ -0,0 +1,7 @@
+# A section cannot grow past 0xffff bytes, the location counter must not wrap
+.data
+.skip 65535
+.skip 10
+.word 1
+x:
+.end